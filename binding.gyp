@@ -5,7 +5,12 @@
       "target_type": "library_static",
       "sources": [ 
         "src/thumbnail.c",
-        "src/vipsthumbnail.c"
+        "src/analytics.c",
+        "src/logging.c",
+        "src/pool.c",
+        "src/vipsthumbnail.c",
+        "src/hangnail_serve.c",
+        "src/hangnail_sync.c"
       ],
 
       "conditions": [
@@ -38,7 +43,12 @@
       "type": 'executable',
       "sources": [
         "src/vipsthumbnail.c",
-        "src/thumbnail.c"
+        "src/hangnail_serve.c",
+        "src/hangnail_sync.c",
+        "src/thumbnail.c",
+        "src/analytics.c",
+        "src/logging.c",
+        "src/pool.c"
       ],
 
       "dependencies": [ 'cuticle_lib' ],
@@ -62,6 +72,9 @@
       "target_name": "cuticle",
       "sources": [ 
         "src/thumbnail.c",
+        "src/analytics.c",
+        "src/logging.c",
+        "src/pool.c",
         "src/cuticle.cpp" 
       ],
 
@@ -0,0 +1,422 @@
+/* Image analytics from the finished thumbnail.
+ *
+ * Services downstream want a perceptual hash for dedup, the dominant
+ * colours and a blurhash placeholder. Rather than decode the original a
+ * second time, we work them out from the thumbnail while it's in memory.
+ * Everything runs on a tiny sample of it, so the cost is lost in the noise.
+ */
+
+#include "analytics.h"
+
+/* Longest side of the sample we work from.
+ */
+#define SAMPLE_SIZE (64)
+
+/* The DCT hash is taken from a 32x32 grey image, keeping the lowest 8x8
+ * frequencies.
+ */
+#define PHASH_SIZE (32)
+#define PHASH_KEEP (8)
+
+/* 3 bits per channel for colour counting.
+ */
+#define COLOUR_BITS (3)
+#define COLOUR_BUCKETS (1 << (3 * COLOUR_BITS))
+
+#define BLURHASH_X (4)
+#define BLURHASH_Y (3)
+
+typedef struct {
+  int width;
+  int height;
+  VipsImage *im;
+} Sample;
+
+static const char base83[] =
+  "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+  "abcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+
+static const unsigned char *
+sample_pixel( Sample *sample, int x, int y )
+{
+  return( VIPS_IMAGE_ADDR( sample->im, x, y ) );
+}
+
+/* Shrink the thumbnail to a few thousand 8-bit sRGB pixels in memory.
+ */
+static int
+analytics_sample( VipsObject *process, VipsImage *in, Sample *sample )
+{
+  VipsImage **t = (VipsImage **) vips_object_local_array( process, 5 );
+  double shrink = (double) VIPS_MAX( in->Xsize, in->Ysize ) / SAMPLE_SIZE;
+
+  if( vips_colourspace( in, &t[0], VIPS_INTERPRETATION_sRGB, NULL ) ||
+    vips_cast( t[0], &t[1], VIPS_FORMAT_UCHAR, NULL ) ) {
+    return( -1 );
+  }
+  in = t[1];
+
+  /* Ignore any alpha.
+   */
+  if( in->Bands > 3 ) {
+    if( vips_extract_band( in, &t[2], 0, "n", 3, NULL ) ) {
+      return( -1 );
+    }
+    in = t[2];
+  }
+
+  if( shrink > 1.0 ) {
+    if( vips_shrink( in, &t[3], shrink, shrink, NULL ) ) {
+      return( -1 );
+    }
+    in = t[3];
+  }
+
+  t[4] = vips_image_new_memory();
+  if( vips_image_write( in, t[4] ) ||
+    vips_image_wio_input( t[4] ) ) {
+    return( -1 );
+  }
+
+  if( t[4]->Bands != 3 ) {
+    thumbnail_error( "analytics", "expected an sRGB image, got %d bands", t[4]->Bands );
+    return( -1 );
+  }
+
+  sample->im = t[4];
+  sample->width = t[4]->Xsize;
+  sample->height = t[4]->Ysize;
+
+  return( 0 );
+}
+
+static int
+compare_double( const void *a, const void *b )
+{
+  double x = *((const double *) a);
+  double y = *((const double *) b);
+
+  return( x < y ? -1 : x > y ? 1 : 0 );
+}
+
+/* Classic pHash: DCT of a 32x32 grey image, one bit per low frequency for
+ * whether it's above the median. The DC term is left out of the median and
+ * its bit is always zero.
+ */
+static guint64
+analytics_phash( Sample *sample )
+{
+  double grey[PHASH_SIZE][PHASH_SIZE];
+  double basis[PHASH_KEEP][PHASH_SIZE];
+  double rows[PHASH_SIZE][PHASH_KEEP];
+  double dct[PHASH_KEEP * PHASH_KEEP];
+  double sorted[PHASH_KEEP * PHASH_KEEP - 1];
+  double median;
+  guint64 hash;
+  int x, y, u, v;
+
+  /* Box filter the sample down to 32x32, or point sample it up.
+   */
+  for( y = 0; y < PHASH_SIZE; y++ ) {
+    int top = y * sample->height / PHASH_SIZE;
+    int bottom = VIPS_MAX( top + 1, (y + 1) * sample->height / PHASH_SIZE );
+
+    for( x = 0; x < PHASH_SIZE; x++ ) {
+      int left = x * sample->width / PHASH_SIZE;
+      int right = VIPS_MAX( left + 1, (x + 1) * sample->width / PHASH_SIZE );
+      double sum = 0.0;
+      int i, j;
+
+      for( j = top; j < bottom; j++ ) {
+        for( i = left; i < right; i++ ) {
+          const unsigned char *p = sample_pixel( sample, i, j );
+
+          sum += 0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2];
+        }
+      }
+
+      grey[y][x] = sum / ((bottom - top) * (right - left));
+    }
+  }
+
+  for( u = 0; u < PHASH_KEEP; u++ ) {
+    for( x = 0; x < PHASH_SIZE; x++ ) {
+      basis[u][x] = cos( (2 * x + 1) * u * M_PI / (2 * PHASH_SIZE) );
+    }
+  }
+
+  /* Separable, so rows then columns.
+   */
+  for( y = 0; y < PHASH_SIZE; y++ ) {
+    for( u = 0; u < PHASH_KEEP; u++ ) {
+      double sum = 0.0;
+
+      for( x = 0; x < PHASH_SIZE; x++ ) {
+        sum += grey[y][x] * basis[u][x];
+      }
+
+      rows[y][u] = sum;
+    }
+  }
+
+  for( v = 0; v < PHASH_KEEP; v++ ) {
+    for( u = 0; u < PHASH_KEEP; u++ ) {
+      double sum = 0.0;
+
+      for( y = 0; y < PHASH_SIZE; y++ ) {
+        sum += rows[y][u] * basis[v][y];
+      }
+
+      dct[v * PHASH_KEEP + u] = sum;
+    }
+  }
+
+  memcpy( sorted, dct + 1, sizeof( sorted ) );
+  qsort( sorted, G_N_ELEMENTS( sorted ), sizeof( double ), compare_double );
+  median = sorted[G_N_ELEMENTS( sorted ) / 2];
+
+  hash = 0;
+  for( u = 1; u < PHASH_KEEP * PHASH_KEEP; u++ ) {
+    if( dct[u] > median ) {
+      hash |= (guint64) 1 << (63 - u);
+    }
+  }
+
+  return( hash );
+}
+
+/* Count pixels into coarse buckets and report the mean colour of the most
+ * popular ones.
+ */
+static int
+analytics_colours( Sample *sample, unsigned int *colours )
+{
+  static const int shift = 8 - COLOUR_BITS;
+
+  int count[COLOUR_BUCKETS];
+  int sum[COLOUR_BUCKETS][3];
+  int n_colours;
+  int x, y, i;
+
+  memset( count, 0, sizeof( count ) );
+  memset( sum, 0, sizeof( sum ) );
+
+  for( y = 0; y < sample->height; y++ ) {
+    for( x = 0; x < sample->width; x++ ) {
+      const unsigned char *p = sample_pixel( sample, x, y );
+      int bucket =
+        (p[0] >> shift) << (2 * COLOUR_BITS) |
+        (p[1] >> shift) << COLOUR_BITS |
+        (p[2] >> shift);
+
+      count[bucket] += 1;
+      sum[bucket][0] += p[0];
+      sum[bucket][1] += p[1];
+      sum[bucket][2] += p[2];
+    }
+  }
+
+  for( n_colours = 0; n_colours < THUMBNAIL_MAX_COLOURS; n_colours++ ) {
+    int best = 0;
+
+    for( i = 1; i < COLOUR_BUCKETS; i++ ) {
+      if( count[i] > count[best] ) {
+        best = i;
+      }
+    }
+
+    if( !count[best] ) {
+      break;
+    }
+
+    colours[n_colours] =
+      (sum[best][0] / count[best]) << 16 |
+      (sum[best][1] / count[best]) << 8 |
+      (sum[best][2] / count[best]);
+    count[best] = 0;
+  }
+
+  return( n_colours );
+}
+
+static double
+srgb_to_linear( int value )
+{
+  double v = value / 255.0;
+
+  return( v <= 0.04045 ? v / 12.92 : pow( (v + 0.055) / 1.055, 2.4 ) );
+}
+
+static int
+linear_to_srgb( double value )
+{
+  double v = VIPS_CLIP( 0.0, value, 1.0 );
+
+  if( v <= 0.0031308 )
+    return( (int) (v * 12.92 * 255 + 0.5) );
+  else
+    return( (int) ((1.055 * pow( v, 1 / 2.4 ) - 0.055) * 255 + 0.5) );
+}
+
+static double
+sign_pow( double value, double exponent )
+{
+  return( copysign( pow( fabs( value ), exponent ), value ) );
+}
+
+static char *
+encode83( char *p, int value, int length )
+{
+  int divisor = 1;
+  int i;
+
+  for( i = 1; i < length; i++ ) {
+    divisor *= 83;
+  }
+
+  for( i = 0; i < length; i++ ) {
+    *p++ = base83[(value / divisor) % 83];
+    divisor /= 83;
+  }
+
+  return( p );
+}
+
+/* See https://github.com/woltapp/blurhash/blob/master/Algorithm.md
+ */
+static void
+analytics_blurhash( Sample *sample, char *blurhash )
+{
+  double linear[256];
+  double factors[BLURHASH_Y * BLURHASH_X][3];
+  double maximum;
+  char *p;
+  int x, y, i, j, k;
+
+  for( i = 0; i < 256; i++ ) {
+    linear[i] = srgb_to_linear( i );
+  }
+
+  for( j = 0; j < BLURHASH_Y; j++ ) {
+    for( i = 0; i < BLURHASH_X; i++ ) {
+      double normalisation = (i == 0 && j == 0) ? 1.0 : 2.0;
+      double *factor = factors[j * BLURHASH_X + i];
+
+      factor[0] = factor[1] = factor[2] = 0.0;
+
+      for( y = 0; y < sample->height; y++ ) {
+        double ybasis = cos( M_PI * j * y / sample->height );
+
+        for( x = 0; x < sample->width; x++ ) {
+          const unsigned char *q = sample_pixel( sample, x, y );
+          double basis = ybasis * cos( M_PI * i * x / sample->width );
+
+          factor[0] += basis * linear[q[0]];
+          factor[1] += basis * linear[q[1]];
+          factor[2] += basis * linear[q[2]];
+        }
+      }
+
+      for( k = 0; k < 3; k++ ) {
+        factor[k] *= normalisation / (sample->width * sample->height);
+      }
+    }
+  }
+
+  p = blurhash;
+  p = encode83( p, (BLURHASH_X - 1) + (BLURHASH_Y - 1) * 9, 1 );
+
+  maximum = 0.0;
+  for( i = 1; i < BLURHASH_X * BLURHASH_Y; i++ ) {
+    for( k = 0; k < 3; k++ ) {
+      maximum = VIPS_MAX( maximum, fabs( factors[i][k] ) );
+    }
+  }
+
+  {
+    int quantised = VIPS_CLIP( 0, (int) floor( maximum * 166 - 0.5 ), 82 );
+
+    maximum = (quantised + 1) / 166.0;
+    p = encode83( p, quantised, 1 );
+  }
+
+  p = encode83( p,
+    (linear_to_srgb( factors[0][0] ) << 16) +
+    (linear_to_srgb( factors[0][1] ) << 8) +
+    linear_to_srgb( factors[0][2] ), 4 );
+
+  for( i = 1; i < BLURHASH_X * BLURHASH_Y; i++ ) {
+    int q[3];
+
+    for( k = 0; k < 3; k++ ) {
+      q[k] = VIPS_CLIP( 0,
+        (int) floor( sign_pow( factors[i][k] / maximum, 0.5 ) * 9 + 9.5 ), 18 );
+    }
+
+    p = encode83( p, q[0] * 19 * 19 + q[1] * 19 + q[2], 2 );
+  }
+
+  *p = '\0';
+}
+
+int
+thumbnail_analyse( VipsObject *process, VipsImage *im, ThumbnailOptions options, ThumbnailResult *result )
+{
+  Sample sample;
+
+  if( !options.analytics ) {
+    return( 0 );
+  }
+
+  if( analytics_sample( process, im, &sample ) ) {
+    return( -1 );
+  }
+
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "analytics", "analysing %dx%d sample", sample.width, sample.height );
+
+  if( options.analytics & THUMBNAIL_ANALYTICS_PHASH ) {
+    result->phash = analytics_phash( &sample );
+  }
+
+  if( options.analytics & THUMBNAIL_ANALYTICS_COLOURS ) {
+    result->n_colours = analytics_colours( &sample, result->colours );
+  }
+
+  if( options.analytics & THUMBNAIL_ANALYTICS_BLURHASH ) {
+    analytics_blurhash( &sample, result->blurhash );
+  }
+
+  result->analytics = options.analytics;
+
+  return( 0 );
+}
+
+int
+thumbnail_analytics_parse( const char *list )
+{
+  char **names = g_strsplit( list, ",", -1 );
+  int analytics = 0;
+  int i;
+
+  for( i = 0; names[i]; i++ ) {
+    char *name = g_strstrip( names[i] );
+
+    if( !*name )
+      continue;
+    else if( strcmp( name, "phash" ) == 0 )
+      analytics |= THUMBNAIL_ANALYTICS_PHASH;
+    else if( strcmp( name, "colours" ) == 0 || strcmp( name, "colors" ) == 0 )
+      analytics |= THUMBNAIL_ANALYTICS_COLOURS;
+    else if( strcmp( name, "blurhash" ) == 0 )
+      analytics |= THUMBNAIL_ANALYTICS_BLURHASH;
+    else {
+      thumbnail_error( "analytics", "unknown analytic \"%s\"", name );
+      analytics = -1;
+      break;
+    }
+  }
+
+  g_strfreev( names );
+
+  return( analytics );
+}
@@ -0,0 +1,12 @@
+#ifndef ANALYTICS_H
+#define ANALYTICS_H
+
+#include "thumbnail.h"
+
+/* Fill in the analytics asked for in options from @im, the finished
+ * thumbnail. @im should already be in memory, we read it more than once.
+ */
+int
+thumbnail_analyse( VipsObject *process, VipsImage *im, ThumbnailOptions options, ThumbnailResult *result );
+
+#endif /*ANALYTICS_H*/
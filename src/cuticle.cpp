@@ -1,5 +1,10 @@
-#include <node.h>
+#define NAPI_VERSION 6
+#include <node_api.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <iostream>
+#include <map>
+#include <vector>
 
 extern "C" {
   #include "thumbnail.h"
@@ -8,79 +13,888 @@ extern "C" {
 static const std::string CROP_STYLE_ASPECTFIT = "aspectfit";
 static const std::string CROP_STYLE_ASPECTFILL = "aspectfill";
 
-using namespace v8;
+// One of these for each isolate (main thread or worker_thread) that loads
+// us. Jobs finish on our own threads and are handed back to the isolate that
+// asked through its threadsafe function.
+//
+// Pool threads may still hold a reference after the isolate has gone away,
+// so it's refcounted, and alive and refs are only touched under engineLock.
+struct EnvState {
+  napi_threadsafe_function done;
+  bool alive;
+  int refs;
 
-// Forward declaration:
-static int Transform(std::string& sourcePath, int width, int height, std::string& aspect, std::string& outputPath) {
+  // Jobs waiting in this isolate, and its log subscriber if any. Only
+  // touched from its thread.
+  int pending;
+  napi_ref logCallback;
+  ThumbnailLogLevel logLevel;
+};
+
+// A line of a job's log, kept until the job is handed back.
+struct LogRecord {
+  ThumbnailLogLevel level;
+  std::string context;
+  std::string event;
+  std::string message;
+};
+
+struct TransformJob;
+
+// Someone waiting for a job: the callback to call and where to call it.
+struct Waiter {
+  EnvState* state;
+  napi_ref callback;
+  TransformJob* job;
+};
+
+// A thumbnail being made on the shared pool. Identical requests that arrive
+// while it runs, from any isolate, wait on the same job rather than starting
+// their own, so we don't burn CPU on duplicates or have them race to write
+// the same output file.
+//
+// refs counts the waiters plus any Buffers handed out over output data,
+// which are shared rather than copied. Whoever drops the last one frees it.
+struct TransformJob {
+  std::string key;
+  gint refs;
+
+  std::string sourcePath;
+  int width;
+  int height;
+  std::string aspect;
+  // One path or suffix per output. outputArray is set if they were passed
+  // as an array, and are handed back as one.
+  std::vector<std::string> outputPaths;
+  bool outputArray;
+  int analytics;
+  size_t maxBytes;
+  int page;
+  int pages;
+  bool passthrough;
+
+  std::string pyramidOutput;
+  int pyramidTileSize;
+  int pyramidOverlap;
+  std::string pyramidSuffix;
+  std::string pyramidLayout;
+
+  int threads;
+  int cacheTileHeight;
+  int cacheTiles;
+
+  ThumbnailResult result;
+
+  // Only written by the job's own thread while it runs.
+  ThumbnailLog log;
+  std::vector<LogRecord> records;
+
+  std::vector<Waiter*> waiters;
+};
+
+// The engine, the pool and the job table are shared by every isolate in
+// the process. engineLock guards inFlight, the waiters of jobs in it,
+// EnvState alive and refs, and logSubscribers.
+static GMutex engineLock;
+static GThreadPool* pool;
+static std::map<std::string, TransformJob*> inFlight;
+
+// How many isolates want each log level. Jobs log from the lowest level
+// anyone wants, or not at all.
+static int logSubscribers[THUMBNAIL_LOG_NONE];
+
+static std::string NormalizePath(const std::string& path) {
+  char resolved[PATH_MAX];
+
+  if(realpath(path.c_str(), resolved)) {
+    return std::string(resolved);
+  }
+
+  return path;
+}
+
+// File outputs are compared by the directory they resolve to, the way the
+// source is, keeping any save options. Outputs starting with '.' encode to
+// memory and are compared as they are.
+static std::string NormalizeOutput(const std::string& output) {
+  if(output.empty() || output[0] == '.') {
+    return output;
+  }
+
+  size_t options = output.rfind('[');
+  std::string path = output.substr(0, options);
+  char* directory = g_path_get_dirname(path.c_str());
+  char* base = g_path_get_basename(path.c_str());
+  char resolved[PATH_MAX];
+  std::string normalized = output;
+
+  if(realpath(directory, resolved)) {
+    char* file = g_build_filename(resolved, base, NULL);
+
+    normalized = file;
+    if(options != std::string::npos) {
+      normalized += output.substr(options);
+    }
+    g_free(file);
+  }
+
+  g_free(directory);
+  g_free(base);
+
+  return normalized;
+}
+
+static std::string JobKey(TransformJob* job) {
+  std::string key = NormalizePath(job->sourcePath);
+  char numbers[128];
+
+  snprintf(numbers, sizeof(numbers), "%d %d %d %d %zu %d %d %d %d %d",
+    job->width, job->height, CROP_STYLE_ASPECTFILL.compare(job->aspect) == 0, job->analytics,
+    job->maxBytes, job->page, job->pages, job->passthrough, job->pyramidTileSize, job->pyramidOverlap);
+
+  key += '\0';
+  key += numbers;
+  key += '\0';
+  key += job->outputArray ? "[" : "";
+  for(size_t i = 0; i < job->outputPaths.size(); i++) {
+    key += NormalizeOutput(job->outputPaths[i]);
+    key += '\0';
+  }
+  key += NormalizeOutput(job->pyramidOutput);
+  key += '\0';
+  key += job->pyramidSuffix;
+  key += '\0';
+  key += job->pyramidLayout;
+
+  return key;
+}
+
+static void JobUnref(TransformJob* job) {
+  if(g_atomic_int_dec_and_test(&job->refs)) {
+    thumbnail_result_clear(&job->result);
+    delete job;
+  }
+}
+
+// Call with engineLock held.
+static void EnvStateUnref(EnvState* state) {
+  if(--state->refs == 0) {
+    delete state;
+  }
+}
+
+// Runs on the job's thread.
+static void JobLog(ThumbnailLogLevel level, const char* context, const char* event, const char* message, void* user_data) {
+  TransformJob* job = static_cast<TransformJob*>(user_data);
+  LogRecord record = { level, context, event, message };
+
+  job->records.push_back(record);
+}
+
+// Call with engineLock held.
+static ThumbnailLogLevel LogLevelWanted() {
+  for(int level = THUMBNAIL_LOG_DEBUG; level < THUMBNAIL_LOG_NONE; level++) {
+    if(logSubscribers[level]) {
+      return (ThumbnailLogLevel) level;
+    }
+  }
+
+  return THUMBNAIL_LOG_NONE;
+}
+
+static void Transform(TransformJob* job) {
   ThumbnailOptions options = ThumbnailOptionsWithDefaults();
-  options.thumbnail_width = width;
-  options.thumbnail_height = height;
-  options.crop_image = CROP_STYLE_ASPECTFILL.compare(aspect) == 0;
-  options.output_format = outputPath.c_str();
+  options.thumbnail_width = job->width;
+  options.thumbnail_height = job->height;
+  options.crop_image = CROP_STYLE_ASPECTFILL.compare(job->aspect) == 0;
+  options.output_format = job->outputPaths[0].c_str();
+  options.analytics = job->analytics;
+  options.max_bytes = job->maxBytes;
+  options.page = job->page;
+  options.n_pages = job->pages;
+  options.passthrough = job->passthrough;
+
+  // Every output is encoded from the one render.
+  std::vector<const char*> formats;
+
+  if(job->outputPaths.size() > 1) {
+    for(size_t i = 0; i < job->outputPaths.size(); i++) {
+      formats.push_back(job->outputPaths[i].c_str());
+    }
+    formats.push_back(NULL);
+    options.output_formats = &formats[0];
+  }
+
+  if(!job->pyramidOutput.empty()) {
+    options.pyramid_output = job->pyramidOutput.c_str();
+    options.pyramid_tile_size = job->pyramidTileSize;
+    options.pyramid_overlap = job->pyramidOverlap;
+    options.pyramid_suffix = job->pyramidSuffix.c_str();
+    options.pyramid_layout = job->pyramidLayout.c_str();
+  }
+
+  options.threads = job->threads;
+  options.cache_tile_height = job->cacheTileHeight;
+  options.cache_max_tiles = job->cacheTiles;
+
+  // With nobody subscribed, errors go to stderr through the default log.
+  if(job->log.level < THUMBNAIL_LOG_NONE) {
+    options.log = &job->log;
+  }
+
+  ThumbnailSource source = { job->sourcePath.c_str(), NULL, 0 };
+  VipsObject *process = VIPS_OBJECT(vips_image_new());
+
+  // Any failure is in job->result.
+  thumbnail_process_source(process, source, options, &job->result);
+
+  g_object_unref(process);
+}
+
+// Runs on a pool thread.
+static void TransformWork(gpointer data, gpointer user_data) {
+  TransformJob* job = static_cast<TransformJob*>(data);
+
+  Transform(job);
+
+  // Hold on to the job while we hand it out, waiters may be done with it
+  // before we are.
+  g_atomic_int_inc(&job->refs);
+
+  // Anyone asking from here on gets a fresh job, so the waiter list is
+  // final once we're out of the table.
+  g_mutex_lock(&engineLock);
+  inFlight.erase(job->key);
+
+  for(size_t i = 0; i < job->waiters.size(); i++) {
+    Waiter* waiter = job->waiters[i];
+
+    if(waiter->state->alive &&
+      napi_call_threadsafe_function(waiter->state->done, waiter, napi_tsfn_nonblocking) == napi_ok) {
+      continue;
+    }
+
+    // The isolate has gone, nobody to tell.
+    EnvStateUnref(waiter->state);
+    delete waiter;
+    JobUnref(job);
+  }
+
+  g_mutex_unlock(&engineLock);
+
+  JobUnref(job);
+}
+
+static void SetInteger(napi_env env, napi_value object, const char* name, int64_t number) {
+  napi_value value;
+
+  napi_create_int64(env, number, &value);
+  napi_set_named_property(env, object, name, value);
+}
+
+static void SetString(napi_env env, napi_value object, const char* name, const char* text) {
+  napi_value value;
+
+  napi_create_string_utf8(env, text, NAPI_AUTO_LENGTH, &value);
+  napi_set_named_property(env, object, name, value);
+}
+
+// The extra information asked for in the options.
+static napi_value ResultInfo(napi_env env, ThumbnailResult* result) {
+  napi_value info;
+  napi_value value;
+  char text[64];
+
+  napi_create_object(env, &info);
+
+  if(result->outputs[0].quality) {
+    SetInteger(env, info, "quality", result->outputs[0].quality);
+    napi_get_boolean(env, result->outputs[0].over_budget, &value);
+    napi_set_named_property(env, info, "overBudget", value);
+  }
+
+  // With several outputs, each gets its own quality.
+  if(result->n_outputs > 1) {
+    napi_value outputs;
+
+    napi_create_array_with_length(env, result->n_outputs, &outputs);
+
+    for(int i = 0; i < result->n_outputs; i++) {
+      napi_value output;
+
+      napi_create_object(env, &output);
+      if(result->outputs[i].quality) {
+        SetInteger(env, output, "quality", result->outputs[i].quality);
+        napi_get_boolean(env, result->outputs[i].over_budget, &value);
+        napi_set_named_property(env, output, "overBudget", value);
+      }
+      napi_set_element(env, outputs, i, output);
+    }
+
+    napi_set_named_property(env, info, "outputs", outputs);
+  }
+
+  if(result->n_frames > 1) {
+    SetInteger(env, info, "frames", result->n_frames);
+  }
+
+  if(result->pyramid_name) {
+    SetString(env, info, "pyramid", result->pyramid_name);
+  }
+
+  if(result->analytics & THUMBNAIL_ANALYTICS_PHASH) {
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long) result->phash);
+    SetString(env, info, "phash", text);
+  }
+
+  if(result->analytics & THUMBNAIL_ANALYTICS_COLOURS) {
+    napi_value colours;
+
+    napi_create_array_with_length(env, result->n_colours, &colours);
+
+    for(int i = 0; i < result->n_colours; i++) {
+      snprintf(text, sizeof(text), "#%06x", result->colours[i]);
+      napi_create_string_utf8(env, text, NAPI_AUTO_LENGTH, &value);
+      napi_set_element(env, colours, i, value);
+    }
+
+    napi_set_named_property(env, info, "colours", colours);
+  }
+
+  if(result->analytics & THUMBNAIL_ANALYTICS_BLURHASH) {
+    SetString(env, info, "blurhash", result->blurhash);
+  }
+
+  if(result->threads) {
+    napi_value stats;
+
+    napi_create_object(env, &stats);
+    SetInteger(env, stats, "threads", result->threads);
+    SetInteger(env, stats, "cacheTileHeight", result->cache_tile_height);
+    SetInteger(env, stats, "cacheTiles", result->cache_max_tiles);
+    SetInteger(env, stats, "cacheBytes", result->cache_bytes);
+
+    // Process-wide, as the job finished.
+    napi_value pool;
+
+    napi_create_object(env, &pool);
+    SetInteger(env, pool, "hits", result->pool.hits);
+    SetInteger(env, pool, "misses", result->pool.misses);
+    SetInteger(env, pool, "heldBytes", result->pool.held_bytes);
+    napi_set_named_property(env, stats, "pool", pool);
+    napi_set_named_property(env, info, "stats", stats);
+  }
+
+  return info;
+}
+
+// An Error with code set to the ThumbnailError name, like "load", and
+// status to its number.
+static napi_value ResultError(napi_env env, ThumbnailResult* result) {
+  napi_value error;
+  napi_value code;
+  napi_value message;
+
+  napi_create_string_utf8(env, thumbnail_error_name(result->error), NAPI_AUTO_LENGTH, &code);
+  napi_create_string_utf8(env, result->error_message ? result->error_message : "", NAPI_AUTO_LENGTH, &message);
+  napi_create_error(env, code, message, &error);
+  SetInteger(env, error, "status", result->error);
+
+  return error;
+}
+
+// Pass the job's log to the isolate's subscriber.
+static void DeliverLog(napi_env env, EnvState* state, TransformJob* job) {
+  napi_value callback;
+  napi_value global;
+
+  if(!state->logCallback ||
+    job->records.empty() ||
+    napi_get_reference_value(env, state->logCallback, &callback) != napi_ok) {
+    return;
+  }
+
+  napi_get_global(env, &global);
+
+  for(size_t i = 0; i < job->records.size(); i++) {
+    LogRecord* record = &job->records[i];
+    napi_value entry;
+
+    if(record->level < state->logLevel) {
+      continue;
+    }
+
+    napi_create_object(env, &entry);
+    SetString(env, entry, "level", thumbnail_log_level_name(record->level));
+    SetString(env, entry, "context", record->context.c_str());
+    SetString(env, entry, "event", record->event.c_str());
+    SetString(env, entry, "message", record->message.c_str());
+    SetString(env, entry, "source", job->sourcePath.c_str());
+
+    if(napi_call_function(env, global, callback, 1, &entry, NULL) == napi_pending_exception) {
+      napi_value exception;
+
+      napi_get_and_clear_last_exception(env, &exception);
+      napi_fatal_exception(env, exception);
+      return;
+    }
+  }
+}
+
+static void OutputFinalize(napi_env env, void* data, void* hint) {
+  JobUnref(static_cast<TransformJob*>(hint));
+}
+
+// The path for outputs written to a file, otherwise a Buffer over the
+// encoded thumbnail. Every waiter, in any isolate, shares the one copy in
+// the buffer pool, so don't write to it. It goes back to the pool once the
+// last Buffer over the job is collected.
+static napi_value ResultOutput(napi_env env, TransformJob* job, size_t i) {
+  ThumbnailOutput* result = &job->result.outputs[i];
+  napi_value output;
+
+  if(!result->data) {
+    napi_create_string_utf8(env, job->outputPaths[i].c_str(), NAPI_AUTO_LENGTH, &output);
+    return output;
+  }
+
+  g_atomic_int_inc(&job->refs);
+
+  if(napi_create_external_buffer(env, result->length, result->data,
+      OutputFinalize, job, &output) != napi_ok) {
+    // Some runtimes won't take memory they didn't allocate.
+    JobUnref(job);
+    napi_create_buffer_copy(env, result->length, result->data, NULL, &output);
+  }
+
+  return output;
+}
+
+// One output, or an array of them in order if outputs came as an array.
+static napi_value ResultOutputs(napi_env env, TransformJob* job) {
+  napi_value outputs;
+
+  if(!job->outputArray) {
+    return ResultOutput(env, job, 0);
+  }
+
+  napi_create_array_with_length(env, job->outputPaths.size(), &outputs);
+
+  for(size_t i = 0; i < job->outputPaths.size(); i++) {
+    napi_set_element(env, outputs, i, ResultOutput(env, job, i));
+  }
+
+  return outputs;
+}
+
+// Runs on the waiter's isolate thread, or with env NULL if the isolate is
+// shutting down with calls still queued.
+static void TransformAfter(napi_env env, napi_value js_callback, void* context, void* data) {
+  Waiter* waiter = static_cast<Waiter*>(data);
+  EnvState* state = waiter->state;
+  TransformJob* job = waiter->job;
+
+  if(env) {
+    napi_handle_scope scope;
+    napi_value callback;
+    napi_value global;
+    napi_value argv[3];
+
+    napi_open_handle_scope(env, &scope);
+
+    DeliverLog(env, state, job);
+
+    if(job->result.error) {
+      argv[0] = ResultError(env, &job->result);
+    }
+    else {
+      napi_get_null(env, &argv[0]);
+    }
+    argv[1] = ResultOutputs(env, job);
+    argv[2] = ResultInfo(env, &job->result);
+
+    napi_get_reference_value(env, waiter->callback, &callback);
+    napi_get_global(env, &global);
+
+    if(napi_call_function(env, global, callback, 3, argv, NULL) == napi_pending_exception) {
+      napi_value exception;
+
+      napi_get_and_clear_last_exception(env, &exception);
+      napi_fatal_exception(env, exception);
+    }
+
+    napi_delete_reference(env, waiter->callback);
+    napi_close_handle_scope(env, scope);
+
+    // Let the isolate exit once it has nothing left to wait for.
+    if(--state->pending == 0) {
+      napi_unref_threadsafe_function(env, state->done);
+    }
+  }
+
+  g_mutex_lock(&engineLock);
+  EnvStateUnref(state);
+  g_mutex_unlock(&engineLock);
+
+  delete waiter;
+  JobUnref(job);
+}
+
+// The isolate is going away. Stop pool threads calling into it.
+static void EnvCleanup(void* data) {
+  EnvState* state = static_cast<EnvState*>(data);
+
+  g_mutex_lock(&engineLock);
+  state->alive = false;
+  if(state->logCallback) {
+    logSubscribers[state->logLevel] -= 1;
+  }
+  g_mutex_unlock(&engineLock);
+
+  napi_release_threadsafe_function(state->done, napi_tsfn_abort);
+}
+
+static void EnvFinalize(napi_env env, void* data, void* hint) {
+  g_mutex_lock(&engineLock);
+  EnvStateUnref(static_cast<EnvState*>(data));
+  g_mutex_unlock(&engineLock);
+}
+
+static bool GetProperty(napi_env env, napi_value object, const char* name, napi_valuetype wanted, napi_value* value) {
+  napi_valuetype type;
+
+  return napi_get_named_property(env, object, name, value) == napi_ok &&
+    napi_typeof(env, *value, &type) == napi_ok &&
+    type == wanted;
+}
+
+static std::string StringValue(napi_env env, napi_value value) {
+  napi_value string;
+  size_t length;
+
+  if(napi_coerce_to_string(env, value, &string) != napi_ok ||
+    napi_get_value_string_utf8(env, string, NULL, 0, &length) != napi_ok) {
+    return std::string();
+  }
+
+  std::string text(length, '\0');
+  napi_get_value_string_utf8(env, string, &text[0], length + 1, &length);
+
+  return text;
+}
+
+static int IntegerValue(napi_env env, napi_value value) {
+  napi_value number;
+  int32_t integer = 0;
+
+  if(napi_coerce_to_number(env, value, &number) == napi_ok) {
+    napi_get_value_int32(env, number, &integer);
+  }
+
+  return integer;
+}
+
+static std::string StringOption(napi_env env, napi_value object, const char* name, const std::string& fallback) {
+  napi_value value;
+  napi_valuetype type;
+
+  if(napi_get_named_property(env, object, name, &value) != napi_ok ||
+    napi_typeof(env, value, &type) != napi_ok ||
+    type == napi_undefined || type == napi_null) {
+    return fallback;
+  }
+
+  return StringValue(env, value);
+}
+
+static int IntegerOption(napi_env env, napi_value object, const char* name, int fallback) {
+  napi_value value;
+
+  if(!GetProperty(env, object, name, napi_number, &value)) {
+    return fallback;
+  }
 
-  return simple_transform(sourcePath.c_str(), options);
+  return IntegerValue(env, value);
 }
 
-Handle<Value> NodeTransformImage(const Arguments& args) {
-  HandleScope scope;
+static napi_value NodeTransformImage(napi_env env, napi_callback_info info) {
+  size_t argc = 7;
+  napi_value args[7];
+  EnvState* state;
+  napi_valuetype type;
 
-  // Check that there are enough arguments. If we access an index that doesn't
-  // exist, it'll be Undefined().
-  if(args.Length() != 6) {
+  napi_get_cb_info(env, info, &argc, args, NULL, NULL);
+  napi_get_instance_data(env, (void**) &state);
+
+  // Check that there are enough arguments.
+  if(argc != 6 && argc != 7) {
     // Throw an exception to alert the user to incorrect usage.
-    return scope.Close(ThrowException(
-      Exception::TypeError(String::New("Must pass 7 arguments: "
-        "input path (String), "
-        "width (Integer), "
-        "height (Integer), "
-        "aspect handling (String), "
-        "output path (String), "
-        "callback (Function)"
-      ))
-    ));
+    napi_throw_type_error(env, NULL, "Must pass 6 or 7 arguments: "
+      "input path (String), "
+      "width (Integer), "
+      "height (Integer), "
+      "aspect handling (String), "
+      "output path (String or Array), "
+      "options (Object, optional), "
+      "callback (Function)"
+    );
+    return NULL;
+  }
+
+  napi_typeof(env, args[argc - 1], &type);
+  if(type != napi_function) {
+    napi_throw_type_error(env, NULL, "callback must be a function");
+    return NULL;
+  }
+
+  ThumbnailOptions defaults = ThumbnailOptionsWithDefaults();
+  TransformJob* job = new TransformJob();
+  job->refs = 0;
+  job->outputArray = false;
+  job->analytics = 0;
+  job->maxBytes = 0;
+  job->page = defaults.page;
+  job->pages = defaults.n_pages;
+  job->passthrough = defaults.passthrough;
+  job->pyramidTileSize = defaults.pyramid_tile_size;
+  job->pyramidOverlap = defaults.pyramid_overlap;
+  job->pyramidSuffix = defaults.pyramid_suffix;
+  job->pyramidLayout = defaults.pyramid_layout;
+  job->threads = 0;
+  job->cacheTileHeight = 0;
+  job->cacheTiles = 0;
+  job->log.level = THUMBNAIL_LOG_NONE;
+  job->log.fn = JobLog;
+  job->log.user_data = job;
+  memset(&job->result, 0, sizeof(job->result));
+
+  job->sourcePath = StringValue(env, args[0]);
+  job->width = IntegerValue(env, args[1]);
+  job->height = IntegerValue(env, args[2]);
+  job->aspect = StringValue(env, args[3]);
+
+  // An array of outputs are all encoded from one render.
+  if(napi_is_array(env, args[4], &job->outputArray) == napi_ok && job->outputArray) {
+    uint32_t length = 0;
+
+    napi_get_array_length(env, args[4], &length);
+
+    for(uint32_t i = 0; i < length; i++) {
+      napi_value path;
+
+      napi_get_element(env, args[4], i, &path);
+      job->outputPaths.push_back(StringValue(env, path));
+    }
+
+    if(length < 1 || length > THUMBNAIL_MAX_OUTPUTS) {
+      delete job;
+      napi_throw_range_error(env, NULL, "output path must be a String or an Array of 1 to 8 of them");
+      return NULL;
+    }
   }
+  else {
+    job->outputPaths.push_back(StringValue(env, args[4]));
+  }
+
+  if(argc == 7 && napi_typeof(env, args[5], &type) == napi_ok && type == napi_object) {
+    napi_value options = args[5];
+    napi_value value;
+    bool isArray = false;
+
+    // options.analytics is a list like ['phash', 'colours', 'blurhash'].
+    if(napi_get_named_property(env, options, "analytics", &value) == napi_ok &&
+      napi_is_array(env, value, &isArray) == napi_ok && isArray) {
+      std::string joined;
+      uint32_t length = 0;
+
+      napi_get_array_length(env, value, &length);
 
-  v8::String::Utf8Value srcPathUtf8Value(args[0]->ToString());
-  std::string srcPath = std::string(*srcPathUtf8Value);
+      for(uint32_t i = 0; i < length; i++) {
+        napi_value name;
 
-  v8::String::Utf8Value aspectUtf8Value(args[3]->ToString());
-  std::string aspectHandling = std::string(*aspectUtf8Value);
+        napi_get_element(env, value, i, &name);
+        joined += StringValue(env, name) + ",";
+      }
 
-  v8::String::Utf8Value destPathUtf8Value(args[4]->ToString());
-  std::string destPath = std::string(*destPathUtf8Value);
+      if((job->analytics = thumbnail_analytics_parse(joined.c_str())) < 0) {
+        // Only this thread's own error, the vips buffer may hold another
+        // job's.
+        thumbnail_error_clear();
+        delete job;
+        napi_throw_type_error(env, NULL, "analytics must be a list of 'phash', 'colours' or 'blurhash'");
+        return NULL;
+      }
+    }
 
-  Local<Function> callback = Local<Function>::Cast(args[5]);
+    // options.maxBytes searches for the best quality that fits.
+    job->maxBytes = VIPS_MAX(0, IntegerOption(env, options, "maxBytes", 0));
 
-  const unsigned argc = 2;
-  Local<Value> argv[argc] = {
-    Local<Value>::New(Null()),
-    args[4]
-  };
+    // options.page and pages pick the pages or frames to thumbnail, pages
+    // -1 for all of them.
+    job->page = VIPS_MAX(0, IntegerOption(env, options, "page", job->page));
+    job->pages = IntegerOption(env, options, "pages", job->pages);
+    job->pages = job->pages < 0 ? -1 : VIPS_MAX(1, job->pages);
+
+    // options.passthrough false always re-encodes, even when the source
+    // needs no changes.
+    if(GetProperty(env, options, "passthrough", napi_boolean, &value)) {
+      napi_get_value_bool(env, value, &job->passthrough);
+    }
+
+    // options.threads, cacheTileHeight and cacheTiles override what we'd
+    // pick from the image size. They change how a job runs, not what it
+    // makes, so they aren't part of the job key.
+    job->threads = VIPS_MAX(0, IntegerOption(env, options, "threads", 0));
+    job->cacheTileHeight = VIPS_MAX(0, IntegerOption(env, options, "cacheTileHeight", 0));
+    job->cacheTiles = VIPS_MAX(0, IntegerOption(env, options, "cacheTiles", 0));
+
+    // options.pyramid is { output, tileSize, overlap, format, layout }.
+    if(GetProperty(env, options, "pyramid", napi_object, &value)) {
+      job->pyramidOutput = StringOption(env, value, "output", "");
+      job->pyramidTileSize = IntegerOption(env, value, "tileSize", job->pyramidTileSize);
+      job->pyramidOverlap = IntegerOption(env, value, "overlap", job->pyramidOverlap);
+      job->pyramidSuffix = StringOption(env, value, "format", job->pyramidSuffix);
+      job->pyramidLayout = StringOption(env, value, "layout", job->pyramidLayout);
+    }
+  }
 
-  int error = Transform(srcPath, 
-                args[1]->ToInteger()->Value(), 
-                args[2]->ToInteger()->Value(), 
-                aspectHandling, 
-                destPath
-               );
+  Waiter* waiter = new Waiter();
+  waiter->state = state;
+  napi_create_reference(env, args[argc - 1], 1, &waiter->callback);
 
-  if(error) {
-    argv[0] = Integer::New(error);
+  // Keep the isolate alive until we've called back.
+  if(state->pending++ == 0) {
+    napi_ref_threadsafe_function(env, state->done);
   }
 
-  callback->Call(Context::GetCurrent()->Global(), argc, argv);
+  job->key = JobKey(job);
 
-  return scope.Close(Undefined());
+  g_mutex_lock(&engineLock);
+  state->refs += 1;
+
+  std::map<std::string, TransformJob*>::iterator running = inFlight.find(job->key);
+
+  if(running != inFlight.end()) {
+    delete job;
+    job = running->second;
+  }
+  else {
+    job->log.level = LogLevelWanted();
+    inFlight[job->key] = job;
+    g_thread_pool_push(pool, job, NULL);
+  }
+
+  waiter->job = job;
+  g_atomic_int_inc(&job->refs);
+  job->waiters.push_back(waiter);
+  g_mutex_unlock(&engineLock);
+
+  return NULL;
 }
 
-void RegisterModule(v8::Handle<v8::Object> target) {
-  // You can add properties to the module in this function. It is called
-  // when the module is required by node.
-  target->Set(String::NewSymbol("transform"),
-              FunctionTemplate::New(NodeTransformImage)->GetFunction());
+// onLog(level, fn) calls fn({ level, context, event, message, source }) for
+// each line at or above level logged by this isolate's jobs, just before
+// their callbacks run. onLog(null) stops. Jobs shared with other isolates
+// log at the lowest level any of them asked for.
+static napi_value NodeOnLog(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value args[2];
+  EnvState* state;
+  napi_valuetype type = napi_undefined;
+  int level = THUMBNAIL_LOG_NONE;
+
+  napi_get_cb_info(env, info, &argc, args, NULL, NULL);
+  napi_get_instance_data(env, (void**) &state);
+
+  if(argc == 2) {
+    napi_typeof(env, args[1], &type);
+  }
+
+  if(type == napi_function &&
+    (level = thumbnail_log_level_parse(StringValue(env, args[0]).c_str())) < 0) {
+    napi_throw_type_error(env, NULL, "level must be 'debug', 'info', 'warn' or 'error'");
+    return NULL;
+  }
+
+  if(state->logCallback) {
+    napi_delete_reference(env, state->logCallback);
+    state->logCallback = NULL;
+  }
+
+  g_mutex_lock(&engineLock);
+  if(state->logLevel < THUMBNAIL_LOG_NONE) {
+    logSubscribers[state->logLevel] -= 1;
+  }
+  state->logLevel = THUMBNAIL_LOG_NONE;
+
+  if(type == napi_function && level < THUMBNAIL_LOG_NONE) {
+    state->logLevel = (ThumbnailLogLevel) level;
+    logSubscribers[level] += 1;
+    napi_create_reference(env, args[1], 1, &state->logCallback);
+  }
+  g_mutex_unlock(&engineLock);
+
+  return NULL;
 }
 
-// Register the module with node. Note that "modulename" must be the same as
-// the basename of the resulting .node file. You can specify that name in
-// binding.gyp ("target_name"). When you change it there, change it here too.
-NODE_MODULE(cuticle, RegisterModule);
\ No newline at end of file
+// Start vips and the job pool once for the whole process, however many
+// isolates load us.
+static gpointer EngineStart(gpointer data) {
+  if(vips_init("cuticle")) {
+    std::cerr << "cuticle: unable to start VIPS" << std::endl;
+  }
+
+  g_mutex_init(&engineLock);
+  thumbnail_log_init();
+
+  // Small jobs run in the pool thread that picks them up and a big one
+  // takes the vips workers while no other job has them, see
+  // thumbnail_reserve_threads(), so a thread per core keeps everything busy.
+  pool = g_thread_pool_new(TransformWork, NULL, g_get_num_processors(), FALSE, NULL);
+
+  return NULL;
+}
+
+// Called for each isolate that loads us, the main thread and any
+// worker_threads alike.
+NAPI_MODULE_INIT() {
+  static GOnce engineOnce = G_ONCE_INIT;
+  EnvState* state = new EnvState();
+  napi_value name;
+  napi_value transform;
+  napi_value onLog;
+
+  g_once(&engineOnce, EngineStart, NULL);
+
+  state->alive = true;
+  state->pending = 0;
+  state->logCallback = NULL;
+  state->logLevel = THUMBNAIL_LOG_NONE;
+
+  // The isolate's own reference, dropped in EnvFinalize.
+  state->refs = 1;
+
+  napi_create_string_utf8(env, "cuticle", NAPI_AUTO_LENGTH, &name);
+
+  if(napi_create_threadsafe_function(env, NULL, NULL, name, 0, 1, NULL, NULL, state,
+      TransformAfter, &state->done) != napi_ok) {
+    delete state;
+    napi_throw_error(env, NULL, "cuticle: unable to create completion queue");
+    return NULL;
+  }
+  napi_unref_threadsafe_function(env, state->done);
+
+  napi_set_instance_data(env, state, EnvFinalize, NULL);
+
+  // Cleanup hooks run in reverse order, so this one runs before node tears
+  // down the threadsafe function.
+  napi_add_env_cleanup_hook(env, EnvCleanup, state);
+
+  napi_create_function(env, "transform", NAPI_AUTO_LENGTH, NodeTransformImage, NULL, &transform);
+  napi_set_named_property(env, exports, "transform", transform);
+
+  napi_create_function(env, "onLog", NAPI_AUTO_LENGTH, NodeOnLog, NULL, &onLog);
+  napi_set_named_property(env, exports, "onLog", onLog);
+
+  return exports;
+}
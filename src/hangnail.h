@@ -0,0 +1,91 @@
+#ifndef HANGNAIL_H
+#define HANGNAIL_H
+
+#include "thumbnail.h"
+
+/* Parse "SIZE" or "WIDTHxHEIGHT", optionally followed by '>' (only shrink
+ * larger images) or '^' (fill the area).
+ */
+int
+parse_thumbnail_size(char *thumbnail_size, int* w, int* h, ResizeConstraint* constraint);
+
+/* hangnail --serve keeps one warm engine and runs jobs sent to it over a
+ * Unix domain socket.
+ *
+ * Every message is made of frames, a frame being a 32-bit big-endian byte
+ * count followed by that many bytes.
+ *
+ * A request is two frames:
+ *
+ *   header: NUL-terminated "key=value" strings. The keys are the long
+ *     hangnail option names (size, output, interpolator, sharpen, eprofile,
+ *     iprofile, context, max-bytes, page, pages, analytics, pyramid,
+ *     tile-size, overlap, tile-format, layout, threads, cache-tile-height,
+ *     cache-tiles, linear, crop, rotate, delete) plus "passthrough", 0 to
+ *     always re-encode, "source", the path of the image to thumbnail,
+ *     "name", used in place of the source file name when naming output for
+ *     inline images, and "log", the level (debug, info, warn, error) from
+ *     which to send the job's log back. "output" may be given
+ *     up to THUMBNAIL_MAX_OUTPUTS times; every output is encoded from the
+ *     one render.
+ *   data: the image itself when there is no source, otherwise empty.
+ *
+ * A response is two frames:
+ *
+ *   header: "status=N", 0 or a ThumbnailError code, and "elapsed_us=N",
+ *     or "error=TEXT" on failure. Then for each output, in the order asked
+ *     for, "output=PATH" if it was written to a file or "output_bytes=N" if
+ *     it's in the data frame, followed by "quality=Q" and "over_budget=0|1"
+ *     with max-bytes. Then "frames=N" for more than one page or frame,
+ *     "pyramid=NAME" if one was written, and
+ *     "phash=HEX", "colours=#RRGGBB,..." and "blurhash=TEXT" if asked for.
+ *     "threads=N", "cache_tile_height=N", "cache_tiles=N" and
+ *     "cache_bytes=N" say how the job was run, threads being 1 in the job's
+ *     own thread, the vips concurrency on the vips pool, or how many frames
+ *     ran side by side, and "pool_hits=N" and "pool_misses=N" how the
+ *     server's buffer pool is doing. Each "log=LEVEL EVENT TEXT"
+ *     is a line of the job's log, if asked for. The log is cut short to
+ *     keep the header under HANGNAIL_MAX_HEADER, ending with
+ *     "log=warn log truncated, later lines dropped".
+ *   data: the outputs that are a bare suffix like ".jpg", back to back,
+ *     otherwise empty.
+ *
+ * A connection can carry any number of requests, one after the other. Jobs
+ * on different connections run concurrently.
+ */
+#define HANGNAIL_MAX_HEADER (64 * 1024)
+#define HANGNAIL_MAX_DATA (256 * 1024 * 1024)
+
+int
+hangnail_serve( const char *socket_path, ThumbnailOptions defaults, int jobs );
+
+/* Send each of @files to a hangnail server as a job with @options, tagged
+ * with @context if set. A file of "-" sends stdin inline and writes any
+ * in-memory output to stdout.
+ */
+int
+hangnail_client( const char *socket_path, ThumbnailOptions options, const char *context, char **files, int n_files );
+
+/* hangnail --sync keeps a tree of thumbnails in @destination_dir in step
+ * with the images under @source_dir.
+ *
+ * What was made from what is kept in a manifest, HANGNAIL_MANIFEST in
+ * @destination_dir, one line per source:
+ *
+ *   MTIME SIZE CONTENT_HASH OPTIONS_HASH<tab>SOURCE<tab>OUTPUT
+ *
+ * where SOURCE and OUTPUT are relative to their directories and OUTPUT is
+ * empty for files that aren't images. Sources whose mtime and size are
+ * unchanged are skipped without being read; sources whose content hash is
+ * unchanged are skipped without being decoded. Outputs whose source has
+ * gone are removed. Changing any option that affects the output changes
+ * OPTIONS_HASH and redoes everything.
+ *
+ * With @watch, keep going and resync whenever the source tree changes.
+ */
+#define HANGNAIL_MANIFEST ".hangnail-manifest"
+
+int
+hangnail_sync( const char *source_dir, const char *destination_dir, ThumbnailOptions options, int jobs, gboolean watch );
+
+#endif /*HANGNAIL_H*/
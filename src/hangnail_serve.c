@@ -0,0 +1,826 @@
+/* hangnail --serve and --client
+ *
+ * Starting hangnail per image pays for process startup, vips_init, option
+ * parsing and loader discovery every time. In server mode we pay that once
+ * and then run jobs sent over a Unix domain socket. See hangnail.h for the
+ * wire format.
+ */
+
+#include "hangnail.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+/* Connection threads are detached, so each has its own copy of the
+ * defaults rather than a pointer into hangnail_serve()'s frame.
+ */
+typedef struct {
+  int fd;
+  ThumbnailOptions defaults;
+} ServeConnection;
+
+/* Limit the number of jobs running at once. Each connection has its own
+ * thread, so idle connections don't hold up anyone else.
+ */
+static GMutex serve_slot_lock;
+static GCond serve_slot_cond;
+static int serve_slots = 0;
+
+static void
+serve_slot_acquire( void )
+{
+  g_mutex_lock( &serve_slot_lock );
+  while( serve_slots <= 0 ) {
+    g_cond_wait( &serve_slot_cond, &serve_slot_lock );
+  }
+  serve_slots -= 1;
+  g_mutex_unlock( &serve_slot_lock );
+}
+
+static void
+serve_slot_release( void )
+{
+  g_mutex_lock( &serve_slot_lock );
+  serve_slots += 1;
+  g_cond_signal( &serve_slot_cond );
+  g_mutex_unlock( &serve_slot_lock );
+}
+
+/* Read exactly @length bytes. Returns 1 if the peer closed the connection
+ * before sending anything, -1 on error.
+ */
+static int
+read_full( int fd, void *buf, size_t length )
+{
+  size_t done = 0;
+
+  while( done < length ) {
+    ssize_t n = read( fd, (char *) buf + done, length - done );
+
+    if( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if( n == 0 && done == 0 ) {
+      return( 1 );
+    }
+    if( n <= 0 ) {
+      return( -1 );
+    }
+
+    done += n;
+  }
+
+  return( 0 );
+}
+
+static int
+write_full( int fd, const void *buf, size_t length )
+{
+  size_t done = 0;
+
+  while( done < length ) {
+    ssize_t n = write( fd, (const char *) buf + done, length - done );
+
+    if( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if( n <= 0 ) {
+      return( -1 );
+    }
+
+    done += n;
+  }
+
+  return( 0 );
+}
+
+/* Read a frame into a fresh NUL-terminated buffer. Returns 1 on a clean
+ * end of stream.
+ */
+static int
+read_frame( int fd, char **buf, guint32 *length, guint32 max_length )
+{
+  guint32 header;
+  int status;
+
+  *buf = NULL;
+  *length = 0;
+
+  if( (status = read_full( fd, &header, sizeof( header ) )) ) {
+    return( status );
+  }
+
+  *length = ntohl( header );
+
+  if( *length > max_length ) {
+    return( -1 );
+  }
+
+  *buf = g_malloc( *length + 1 );
+  (*buf)[*length] = '\0';
+
+  if( *length && read_full( fd, *buf, *length ) ) {
+    g_free( *buf );
+    *buf = NULL;
+    return( -1 );
+  }
+
+  return( 0 );
+}
+
+static int
+write_frame_header( int fd, size_t length )
+{
+  guint32 header = htonl( (guint32) length );
+
+  return( write_full( fd, &header, sizeof( header ) ) );
+}
+
+static int
+write_frame( int fd, const void *buf, size_t length )
+{
+  if( write_frame_header( fd, length ) ||
+    (length && write_full( fd, buf, length )) ) {
+    return( -1 );
+  }
+
+  return( 0 );
+}
+
+static void
+header_append( GString *header, const char *key, const char *value )
+{
+  g_string_append_printf( header, "%s=%s", key, value );
+  g_string_append_c( header, '\0' );
+}
+
+static gboolean
+option_boolean( const char *value )
+{
+  return( strcmp( value, "0" ) != 0 && strcmp( value, "false" ) != 0 );
+}
+
+/* A job's log goes back to the client with its response, when the request
+ * asks for it. The response header can't be more than HANGNAIL_MAX_HEADER,
+ * so there's no point keeping more than that.
+ */
+static void
+serve_log( ThumbnailLogLevel level, const char *context, const char *event, const char *message, void *user_data )
+{
+  GString *entries = (GString *) user_data;
+  char *text;
+
+  if( entries->len >= HANGNAIL_MAX_HEADER ) {
+    return;
+  }
+
+  text = g_strdup_printf( "%s %s %s", thumbnail_log_level_name( level ), event, message );
+  header_append( entries, "log", text );
+  g_free( text );
+}
+
+/* Room we keep for the line saying the log was cut short.
+ */
+#define SERVE_LOG_MARK (64)
+
+/* Append as many whole log entries as fit in the header, and if some 
+ * don't, a last one to say so.
+ */
+static void
+header_append_log( GString *header, GString *entries )
+{
+  const char *p;
+
+  for( p = entries->str; p < entries->str + entries->len; p += strlen( p ) + 1 ) {
+    size_t length = strlen( p ) + 1;
+
+    if( header->len + length + SERVE_LOG_MARK > HANGNAIL_MAX_HEADER ) {
+      header_append( header, "log", "warn log truncated, later lines dropped" );
+      break;
+    }
+
+    g_string_append_len( header, p, length );
+  }
+}
+
+/* What a request sets up besides options. context is a string we must
+ * free, formats the NULL-terminated list of outputs.
+ */
+typedef struct {
+  ThumbnailLog log;
+  char *context;
+  const char *formats[THUMBNAIL_MAX_OUTPUTS + 1];
+  int n_formats;
+} ServeRequest;
+
+/* Apply a "key=value" request entry on top of the server defaults.
+ */
+static int
+apply_option( ThumbnailOptions *options, ThumbnailSource *source, ServeRequest *request, char *entry )
+{
+  char *key = entry;
+  char *value;
+
+  if( !(value = strchr( entry, '=' )) ) {
+    thumbnail_error( "hangnail", "malformed request entry \"%s\"", entry );
+    return( -1 );
+  }
+  *value++ = '\0';
+
+  if( strcmp( key, "source" ) == 0 || strcmp( key, "name" ) == 0 )
+    source->filename = value;
+  else if( strcmp( key, "size" ) == 0 ) {
+    if( parse_thumbnail_size( value, &options->thumbnail_width, &options->thumbnail_height, &options->resize_constraint ) ) {
+      thumbnail_error( "hangnail", "unable to parse thumbnail size \"%s\"", value );
+      return( -1 );
+    }
+  }
+  else if( strcmp( key, "output" ) == 0 ) {
+    if( request->n_formats == THUMBNAIL_MAX_OUTPUTS ) {
+      thumbnail_error( "hangnail", "more than %d outputs", THUMBNAIL_MAX_OUTPUTS );
+      return( -1 );
+    }
+    request->formats[request->n_formats++] = value;
+  }
+  else if( strcmp( key, "interpolator" ) == 0 )
+    options->interpolator = value;
+  else if( strcmp( key, "sharpen" ) == 0 )
+    options->convolution_mask = value;
+  else if( strcmp( key, "eprofile" ) == 0 )
+    options->export_profile = value;
+  else if( strcmp( key, "iprofile" ) == 0 )
+    options->import_profile = value;
+  else if( strcmp( key, "context" ) == 0 ) {
+    g_free( request->context );
+    request->context = g_strdup_printf( "cuticle %s", value );
+    options->context_name = request->context;
+  }
+  else if( strcmp( key, "analytics" ) == 0 ) {
+    if( (options->analytics = thumbnail_analytics_parse( value )) < 0 ) {
+      return( -1 );
+    }
+  }
+  else if( strcmp( key, "max-bytes" ) == 0 )
+    options->max_bytes = g_ascii_strtoull( value, NULL, 10 );
+  else if( strcmp( key, "page" ) == 0 )
+    options->page = VIPS_MAX( 0, atoi( value ) );
+  else if( strcmp( key, "pages" ) == 0 )
+    options->n_pages = atoi( value ) < 0 ? -1 : VIPS_MAX( 1, atoi( value ) );
+  else if( strcmp( key, "pyramid" ) == 0 )
+    options->pyramid_output = value;
+  else if( strcmp( key, "tile-size" ) == 0 )
+    options->pyramid_tile_size = atoi( value );
+  else if( strcmp( key, "overlap" ) == 0 )
+    options->pyramid_overlap = atoi( value );
+  else if( strcmp( key, "tile-format" ) == 0 )
+    options->pyramid_suffix = value;
+  else if( strcmp( key, "layout" ) == 0 )
+    options->pyramid_layout = value;
+  else if( strcmp( key, "log" ) == 0 ) {
+    int level;
+
+    if( (level = thumbnail_log_level_parse( value )) < 0 ) {
+      thumbnail_error( "hangnail", "unknown log level \"%s\"", value );
+      return( -1 );
+    }
+    request->log.level = level;
+    options->log = &request->log;
+  }
+  else if( strcmp( key, "threads" ) == 0 )
+    options->threads = atoi( value );
+  else if( strcmp( key, "cache-tile-height" ) == 0 )
+    options->cache_tile_height = atoi( value );
+  else if( strcmp( key, "cache-tiles" ) == 0 )
+    options->cache_max_tiles = atoi( value );
+  else if( strcmp( key, "linear" ) == 0 )
+    options->linear_processing = option_boolean( value );
+  else if( strcmp( key, "crop" ) == 0 )
+    options->crop_image = option_boolean( value );
+  else if( strcmp( key, "rotate" ) == 0 )
+    options->rotate_image = option_boolean( value );
+  else if( strcmp( key, "delete" ) == 0 )
+    options->delete_profile = option_boolean( value );
+  else if( strcmp( key, "passthrough" ) == 0 )
+    options->passthrough = option_boolean( value );
+  else {
+    thumbnail_error( "hangnail", "unknown request option \"%s\"", key );
+    return( -1 );
+  }
+
+  return( 0 );
+}
+
+static void
+header_append_analytics( GString *header, ThumbnailResult *result )
+{
+  char value[64];
+  int i;
+
+  if( result->analytics & THUMBNAIL_ANALYTICS_PHASH ) {
+    vips_snprintf( value, sizeof( value ), "%016" G_GINT64_MODIFIER "x", result->phash );
+    header_append( header, "phash", value );
+  }
+
+  if( result->analytics & THUMBNAIL_ANALYTICS_COLOURS ) {
+    g_string_append( header, "colours=" );
+    for( i = 0; i < result->n_colours; i++ ) {
+      g_string_append_printf( header, "%s#%06x", i ? "," : "", result->colours[i] );
+    }
+    g_string_append_c( header, '\0' );
+  }
+
+  if( result->analytics & THUMBNAIL_ANALYTICS_BLURHASH ) {
+    header_append( header, "blurhash", result->blurhash );
+  }
+}
+
+/* Run one request and send back the response.
+ */
+static int
+serve_job( int fd, ThumbnailOptions defaults, char *header, guint32 header_length, char *data, guint32 data_length )
+{
+  ThumbnailOptions options = defaults;
+  ThumbnailSource source = { NULL, NULL, 0 };
+  ThumbnailResult result = { 0 };
+  GString *response = g_string_new( NULL );
+  GString *log_entries = g_string_new( NULL );
+  ServeRequest request = { { THUMBNAIL_LOG_NONE, serve_log, log_entries } };
+  char *error = NULL;
+  char *entry;
+  char number[32];
+  gint64 start;
+  size_t data_out = 0;
+  int status = THUMBNAIL_OK;
+  int i;
+
+  start = g_get_monotonic_time();
+
+  for( entry = header; entry < header + header_length; entry += strlen( entry ) + 1 ) {
+    if( *entry && apply_option( &options, &source, &request, entry ) ) {
+      status = THUMBNAIL_ERROR_REQUEST;
+      break;
+    }
+  }
+
+  /* Several outputs share the one pipeline.
+   */
+  if( request.n_formats ) {
+    options.output_format = request.formats[0];
+  }
+  if( request.n_formats > 1 ) {
+    options.output_formats = request.formats;
+  }
+
+  if( !status ) {
+    if( data_length ) {
+      source.data = data;
+      source.length = data_length;
+    }
+
+    if( !source.data && !source.filename ) {
+      thumbnail_error( "hangnail", "request has no source and no data" );
+      status = THUMBNAIL_ERROR_REQUEST;
+    }
+  }
+
+  if( status ) {
+    error = thumbnail_error_take();
+  }
+  else {
+    VipsObject *process = VIPS_OBJECT( vips_image_new() );
+
+    serve_slot_acquire();
+    if( thumbnail_process_source( process, source, options, &result ) ) {
+      status = result.error;
+      error = g_strdup( result.error_message );
+    }
+    serve_slot_release();
+
+    g_object_unref( process );
+  }
+
+  vips_snprintf( number, sizeof( number ), "%d", status );
+  header_append( response, "status", number );
+  vips_snprintf( number, sizeof( number ), "%" G_GINT64_FORMAT, g_get_monotonic_time() - start );
+  header_append( response, "elapsed_us", number );
+  for( i = 0; i < result.n_outputs; i++ ) {
+    ThumbnailOutput *output = &result.outputs[i];
+
+    if( output->name ) {
+      header_append( response, "output", output->name );
+    }
+    else {
+      vips_snprintf( number, sizeof( number ), "%zu", output->length );
+      header_append( response, "output_bytes", number );
+      data_out += output->length;
+    }
+    if( output->quality ) {
+      vips_snprintf( number, sizeof( number ), "%d", output->quality );
+      header_append( response, "quality", number );
+      header_append( response, "over_budget", output->over_budget ? "1" : "0" );
+    }
+  }
+  if( result.n_frames > 1 ) {
+    vips_snprintf( number, sizeof( number ), "%d", result.n_frames );
+    header_append( response, "frames", number );
+  }
+  if( result.pyramid_name ) {
+    header_append( response, "pyramid", result.pyramid_name );
+  }
+  if( result.threads ) {
+    vips_snprintf( number, sizeof( number ), "%d", result.threads );
+    header_append( response, "threads", number );
+    vips_snprintf( number, sizeof( number ), "%d", result.cache_tile_height );
+    header_append( response, "cache_tile_height", number );
+    vips_snprintf( number, sizeof( number ), "%d", result.cache_max_tiles );
+    header_append( response, "cache_tiles", number );
+    vips_snprintf( number, sizeof( number ), "%zu", result.cache_bytes );
+    header_append( response, "cache_bytes", number );
+    vips_snprintf( number, sizeof( number ), "%" G_GUINT64_FORMAT, result.pool.hits );
+    header_append( response, "pool_hits", number );
+    vips_snprintf( number, sizeof( number ), "%" G_GUINT64_FORMAT, result.pool.misses );
+    header_append( response, "pool_misses", number );
+  }
+  if( error ) {
+    header_append( response, "error", error );
+  }
+  header_append_analytics( response, &result );
+  header_append_log( response, log_entries );
+
+  /* Outputs encoded to memory go back to back in the data frame.
+   */
+  status = write_frame( fd, response->str, response->len ) ||
+    write_frame_header( fd, data_out );
+
+  for( i = 0; i < result.n_outputs && !status; i++ ) {
+    if( result.outputs[i].length ) {
+      status = write_full( fd, result.outputs[i].data, result.outputs[i].length );
+    }
+  }
+
+  thumbnail_result_clear( &result );
+  g_string_free( response, TRUE );
+  g_string_free( log_entries, TRUE );
+  g_free( request.context );
+  g_free( error );
+
+  return( status );
+}
+
+static gpointer
+serve_connection( gpointer user_data )
+{
+  ServeConnection *connection = (ServeConnection *) user_data;
+
+  for(;;) {
+    char *header;
+    char *data;
+    guint32 header_length;
+    guint32 data_length;
+
+    if( read_frame( connection->fd, &header, &header_length, HANGNAIL_MAX_HEADER ) ) {
+      break;
+    }
+
+    if( read_frame( connection->fd, &data, &data_length, HANGNAIL_MAX_DATA ) ) {
+      g_free( header );
+      break;
+    }
+
+    if( serve_job( connection->fd, connection->defaults, header, header_length, data, data_length ) ) {
+      g_free( header );
+      g_free( data );
+      break;
+    }
+
+    g_free( header );
+    g_free( data );
+  }
+
+  close( connection->fd );
+  g_free( connection );
+
+  return( NULL );
+}
+
+static int
+socket_address( const char *socket_path, struct sockaddr_un *address )
+{
+  memset( address, 0, sizeof( *address ) );
+  address->sun_family = AF_UNIX;
+
+  if( strlen( socket_path ) >= sizeof( address->sun_path ) ) {
+    fprintf( stderr, "socket path too long: %s\n", socket_path );
+    return( -1 );
+  }
+
+  strcpy( address->sun_path, socket_path );
+
+  return( 0 );
+}
+
+int
+hangnail_serve( const char *socket_path, ThumbnailOptions defaults, int jobs )
+{
+  struct sockaddr_un address;
+  int listener;
+
+  if( socket_address( socket_path, &address ) ) {
+    return( 1 );
+  }
+
+  /* A client hanging up mid-response shouldn't take the server with it.
+   */
+  signal( SIGPIPE, SIG_IGN );
+
+  serve_slots = jobs > 0 ? jobs : g_get_num_processors();
+
+  if( (listener = socket( AF_UNIX, SOCK_STREAM, 0 )) < 0 ) {
+    perror( "socket" );
+    return( 1 );
+  }
+
+  unlink( socket_path );
+
+  if( bind( listener, (struct sockaddr *) &address, sizeof( address ) ) ||
+    listen( listener, SOMAXCONN ) ) {
+    perror( socket_path );
+    close( listener );
+    return( 1 );
+  }
+
+  thumbnail_log( defaults, THUMBNAIL_LOG_INFO, "serve", "serving on %s, %d jobs at once", socket_path, serve_slots );
+
+  for(;;) {
+    ServeConnection *connection;
+    GThread *thread;
+    int fd;
+
+    if( (fd = accept( listener, NULL, NULL )) < 0 ) {
+      if( errno == EINTR || errno == ECONNABORTED ) {
+        continue;
+      }
+      perror( "accept" );
+      break;
+    }
+
+    connection = g_new( ServeConnection, 1 );
+    connection->fd = fd;
+    connection->defaults = defaults;
+
+    thread = g_thread_new( "hangnail-connection", serve_connection, connection );
+    g_thread_unref( thread );
+  }
+
+  close( listener );
+  unlink( socket_path );
+
+  return( 1 );
+}
+
+static char *
+read_stream( FILE *fp, size_t *length )
+{
+  GByteArray *bytes = g_byte_array_new();
+  guint8 buf[65536];
+  size_t n;
+
+  while( (n = fread( buf, 1, sizeof( buf ), fp )) > 0 ) {
+    g_byte_array_append( bytes, buf, n );
+  }
+
+  *length = bytes->len;
+
+  return( (char *) g_byte_array_free( bytes, FALSE ) );
+}
+
+/* Find @key in a response header, or NULL.
+ */
+static const char *
+header_lookup( const char *header, guint32 header_length, const char *key )
+{
+  const char *entry;
+  size_t key_length = strlen( key );
+
+  for( entry = header; entry < header + header_length; entry += strlen( entry ) + 1 ) {
+    if( strncmp( entry, key, key_length ) == 0 && entry[key_length] == '=' ) {
+      return( entry + key_length + 1 );
+    }
+  }
+
+  return( NULL );
+}
+
+static int
+client_job( int fd, ThumbnailOptions options, const char *context, const char *file )
+{
+  static const char *extras[] = { "frames", "pyramid", "phash", "colours", "blurhash" };
+
+  GString *request = g_string_new( NULL );
+  char number[64];
+  char *data = NULL;
+  size_t data_length = 0;
+  char *header;
+  char *output;
+  guint32 header_length;
+  guint32 output_length;
+  const char *status;
+  const char *value;
+  int failed;
+  int i;
+
+  if( strcmp( file, "-" ) == 0 ) {
+    data = read_stream( stdin, &data_length );
+  }
+  else {
+    char path[PATH_MAX];
+
+    /* The server has its own working directory.
+     */
+    header_append( request, "source", realpath( file, path ) ? path : file );
+  }
+
+  vips_snprintf( number, sizeof( number ), "%dx%d%c",
+    options.thumbnail_width, options.thumbnail_height,
+    options.resize_constraint == FILL_AREA ? '^' : '>' );
+  header_append( request, "size", number );
+  if( options.output_formats ) {
+    for( i = 0; options.output_formats[i]; i++ ) {
+      header_append( request, "output", options.output_formats[i] );
+    }
+  }
+  else {
+    header_append( request, "output", options.output_format );
+  }
+  header_append( request, "interpolator", options.interpolator );
+  header_append( request, "sharpen", options.convolution_mask );
+  if( options.export_profile ) {
+    header_append( request, "eprofile", options.export_profile );
+  }
+  if( options.import_profile ) {
+    header_append( request, "iprofile", options.import_profile );
+  }
+  if( context ) {
+    header_append( request, "context", context );
+  }
+  header_append( request, "log", thumbnail_log_level_name( thumbnail_log_default.level ) );
+  header_append( request, "linear", options.linear_processing ? "1" : "0" );
+  header_append( request, "crop", options.crop_image ? "1" : "0" );
+  header_append( request, "rotate", options.rotate_image ? "1" : "0" );
+  header_append( request, "delete", options.delete_profile ? "1" : "0" );
+  header_append( request, "passthrough", options.passthrough ? "1" : "0" );
+  if( options.max_bytes ) {
+    vips_snprintf( number, sizeof( number ), "%zu", options.max_bytes );
+    header_append( request, "max-bytes", number );
+  }
+  if( options.page ) {
+    vips_snprintf( number, sizeof( number ), "%d", options.page );
+    header_append( request, "page", number );
+  }
+  if( options.n_pages != 1 ) {
+    vips_snprintf( number, sizeof( number ), "%d", options.n_pages );
+    header_append( request, "pages", number );
+  }
+  if( options.threads ) {
+    vips_snprintf( number, sizeof( number ), "%d", options.threads );
+    header_append( request, "threads", number );
+  }
+  if( options.cache_tile_height ) {
+    vips_snprintf( number, sizeof( number ), "%d", options.cache_tile_height );
+    header_append( request, "cache-tile-height", number );
+  }
+  if( options.cache_max_tiles ) {
+    vips_snprintf( number, sizeof( number ), "%d", options.cache_max_tiles );
+    header_append( request, "cache-tiles", number );
+  }
+  if( options.pyramid_output ) {
+    header_append( request, "pyramid", options.pyramid_output );
+    vips_snprintf( number, sizeof( number ), "%d", options.pyramid_tile_size );
+    header_append( request, "tile-size", number );
+    vips_snprintf( number, sizeof( number ), "%d", options.pyramid_overlap );
+    header_append( request, "overlap", number );
+    header_append( request, "tile-format", options.pyramid_suffix );
+    header_append( request, "layout", options.pyramid_layout );
+  }
+  if( options.analytics ) {
+    vips_snprintf( number, sizeof( number ), "%s%s%s",
+      options.analytics & THUMBNAIL_ANALYTICS_PHASH ? "phash," : "",
+      options.analytics & THUMBNAIL_ANALYTICS_COLOURS ? "colours," : "",
+      options.analytics & THUMBNAIL_ANALYTICS_BLURHASH ? "blurhash," : "" );
+    header_append( request, "analytics", number );
+  }
+
+  failed = write_frame( fd, request->str, request->len ) ||
+    write_frame( fd, data, data_length ) ||
+    read_frame( fd, &header, &header_length, HANGNAIL_MAX_HEADER );
+
+  g_string_free( request, TRUE );
+  g_free( data );
+
+  if( failed ) {
+    fprintf( stderr, "%s: lost connection to server\n", file );
+    return( -1 );
+  }
+
+  if( read_frame( fd, &output, &output_length, HANGNAIL_MAX_DATA ) ) {
+    fprintf( stderr, "%s: lost connection to server\n", file );
+    g_free( header );
+    return( -1 );
+  }
+
+  /* Show the job's log, less the error we print below.
+   */
+  for( value = header; value < header + header_length; value += strlen( value ) + 1 ) {
+    if( strncmp( value, "log=", 4 ) == 0 &&
+      strncmp( value + 4, "error ", 6 ) != 0 ) {
+      fprintf( stderr, "%s: %s\n", file, value + 4 );
+    }
+  }
+
+  status = header_lookup( header, header_length, "status" );
+  failed = !status || strcmp( status, "0" ) != 0;
+
+  if( failed ) {
+    value = header_lookup( header, header_length, "error" );
+    fprintf( stderr, "%s: unable to thumbnail (%s)\n%s\n", file, 
+      thumbnail_error_name( status ? atoi( status ) : THUMBNAIL_ERROR_REQUEST ), 
+      value ? value : "" );
+  }
+  else {
+    double elapsed = 0;
+
+    if( (value = header_lookup( header, header_length, "elapsed_us" )) ) {
+      elapsed = g_ascii_strtod( value, NULL ) / 1000.0;
+    }
+
+    if( strcmp( file, "-" ) == 0 && output_length ) {
+      fwrite( output, 1, output_length, stdout );
+      fprintf( stderr, "%s: %u bytes (%.1f ms)\n", file, output_length, elapsed );
+    }
+    else {
+      /* One line per output, in the order they were asked for, each
+       * followed by its quality.
+       */
+      for( value = header; value < header + header_length; value += strlen( value ) + 1 ) {
+        if( strncmp( value, "output=", 7 ) == 0 ) {
+          printf( "%s: %s (%.1f ms)\n", file, value + 7, elapsed );
+        }
+        else if( strncmp( value, "output_bytes=", 13 ) == 0 ) {
+          printf( "%s: %s bytes (%.1f ms)\n", file, value + 13, elapsed );
+        }
+        else if( strncmp( value, "quality=", 8 ) == 0 ) {
+          printf( "  quality: %s\n", value + 8 );
+        }
+      }
+    }
+
+    for( i = 0; i < G_N_ELEMENTS( extras ); i++ ) {
+      if( (value = header_lookup( header, header_length, extras[i] )) ) {
+        printf( "  %s: %s\n", extras[i], value );
+      }
+    }
+  }
+
+  g_free( header );
+  g_free( output );
+
+  return( failed ? -1 : 0 );
+}
+
+int
+hangnail_client( const char *socket_path, ThumbnailOptions options, const char *context, char **files, int n_files )
+{
+  struct sockaddr_un address;
+  int status = 0;
+  int fd;
+  int i;
+
+  if( socket_address( socket_path, &address ) ) {
+    return( 1 );
+  }
+
+  if( (fd = socket( AF_UNIX, SOCK_STREAM, 0 )) < 0 ||
+    connect( fd, (struct sockaddr *) &address, sizeof( address ) ) ) {
+    perror( socket_path );
+    if( fd >= 0 ) {
+      close( fd );
+    }
+    return( 1 );
+  }
+
+  for( i = 0; i < n_files; i++ ) {
+    if( client_job( fd, options, context, files[i] ) ) {
+      status = 1;
+    }
+  }
+
+  close( fd );
+
+  return( status );
+}
@@ -0,0 +1,760 @@
+/* hangnail --sync
+ *
+ * Rerunning hangnail over a whole tree redoes work for every file that
+ * hasn't changed. Instead, remember what each output was made from and
+ * only process the delta. See hangnail.h for the manifest format.
+ */
+
+#include "hangnail.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif /*__linux__*/
+
+#define FNV_OFFSET (14695981039346656037ULL)
+#define FNV_PRIME (1099511628211ULL)
+
+typedef struct {
+  gint64 mtime;
+  gint64 size;
+  guint64 content_hash;
+  guint64 options_hash;
+  char *output;
+  gboolean seen;
+} SyncEntry;
+
+typedef struct {
+  const char *source_dir;
+  const char *destination_dir;
+  char *destination_real;
+  char *manifest_path;
+  ThumbnailOptions options;
+  guint64 options_hash;
+
+  /* Relative source path -> SyncEntry, guarded by lock.
+   */
+  GHashTable *manifest;
+  GMutex lock;
+
+  /* Relative output path -> the relative source path making it this pass,
+   * also guarded by lock. Sources that differ only in their suffix, like
+   * a.png and a.jpg, make the same output, and only one of them can have
+   * it.
+   */
+  GHashTable *claims;
+
+  int processed;
+  int unchanged;
+  int removed;
+  int failed;
+
+#ifdef __linux__
+  int inotify_fd;
+#endif /*__linux__*/
+} Sync;
+
+typedef struct {
+  Sync *sync;
+  char *relative;
+  gint64 mtime;
+  gint64 size;
+} SyncJob;
+
+static guint64
+hash_bytes( guint64 hash, const void *data, size_t length )
+{
+  const unsigned char *p = (const unsigned char *) data;
+  size_t i;
+
+  for( i = 0; i < length; i++ ) {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+
+  return( hash );
+}
+
+static int
+hash_file( const char *filename, guint64 *hash )
+{
+  unsigned char buf[65536];
+  FILE *fp;
+  size_t n;
+
+  if( !(fp = fopen( filename, "rb" )) ) {
+    return( -1 );
+  }
+
+  *hash = FNV_OFFSET;
+  while( (n = fread( buf, 1, sizeof( buf ), fp )) > 0 ) {
+    *hash = hash_bytes( *hash, buf, n );
+  }
+
+  if( ferror( fp ) ) {
+    fclose( fp );
+    return( -1 );
+  }
+
+  fclose( fp );
+
+  return( 0 );
+}
+
+/* Hash everything that changes what we write.
+ */
+static guint64
+hash_options( ThumbnailOptions options )
+{
+  char *text = g_strdup_printf( "%d %d %d %d %d %d %d %d %zu %d %d %s %s %s %s %s %s",
+    options.thumbnail_width, options.thumbnail_height,
+    options.rotate_image, options.crop_image, options.resize_constraint,
+    options.linear_processing, options.delete_profile, options.passthrough, options.max_bytes,
+    options.page, options.n_pages,
+    options.convolution_mask, options.interpolator,
+    options.export_profile ? options.export_profile : "",
+    options.import_profile ? options.import_profile : "",
+    options.output_format,
+    vips_version_string() );
+  guint64 hash = hash_bytes( FNV_OFFSET, text, strlen( text ) );
+
+  g_free( text );
+
+  return( hash );
+}
+
+static gint64
+stat_mtime( struct stat *st )
+{
+#ifdef __linux__
+  return( (gint64) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec );
+#else
+  return( (gint64) st->st_mtime * 1000000000 );
+#endif /*__linux__*/
+}
+
+static void
+sync_entry_free( gpointer data )
+{
+  SyncEntry *entry = (SyncEntry *) data;
+
+  g_free( entry->output );
+  g_free( entry );
+}
+
+static void
+manifest_load( Sync *sync )
+{
+  char *contents;
+  char **lines;
+  int i;
+
+  if( !g_file_get_contents( sync->manifest_path, &contents, NULL, NULL ) ) {
+    return;
+  }
+
+  lines = g_strsplit( contents, "\n", -1 );
+  g_free( contents );
+
+  for( i = 0; lines[i]; i++ ) {
+    char **fields = g_strsplit( lines[i], "\t", 3 );
+    char *p;
+
+    if( g_strv_length( fields ) == 3 ) {
+      SyncEntry *entry = g_new0( SyncEntry, 1 );
+
+      entry->mtime = g_ascii_strtoll( fields[0], &p, 10 );
+      entry->size = g_ascii_strtoll( p, &p, 10 );
+      entry->content_hash = g_ascii_strtoull( p, &p, 16 );
+      entry->options_hash = g_ascii_strtoull( p, &p, 16 );
+      entry->output = g_strdup( fields[2] );
+
+      g_hash_table_replace( sync->manifest, g_strdup( fields[1] ), entry );
+    }
+
+    g_strfreev( fields );
+  }
+
+  g_strfreev( lines );
+}
+
+static void
+manifest_append( gpointer key, gpointer value, gpointer user_data )
+{
+  SyncEntry *entry = (SyncEntry *) value;
+
+  g_string_append_printf( (GString *) user_data,
+    "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %016" G_GINT64_MODIFIER "x %016" G_GINT64_MODIFIER "x\t%s\t%s\n",
+    entry->mtime, entry->size, entry->content_hash, entry->options_hash,
+    (char *) key, entry->output );
+}
+
+/* Write to a temporary and rename, so an interrupted run never leaves a
+ * half-written manifest.
+ */
+static int
+manifest_save( Sync *sync )
+{
+  GString *text = g_string_new( NULL );
+  GError *error = NULL;
+
+  g_hash_table_foreach( sync->manifest, manifest_append, text );
+
+  if( !g_file_set_contents( sync->manifest_path, text->str, text->len, &error ) ) {
+    fprintf( stderr, "%s\n", error->message );
+    g_error_free( error );
+    g_string_free( text, TRUE );
+    return( -1 );
+  }
+
+  g_string_free( text, TRUE );
+
+  return( 0 );
+}
+
+/* The destination directory matching the one @relative is in. 
+ * output_format is taken from here.
+ */
+static char *
+output_directory_for( Sync *sync, const char *relative )
+{
+  char *directory = g_path_get_dirname( relative );
+  char *path;
+
+  if( strcmp( directory, "." ) == 0 ) {
+    path = g_strdup( sync->destination_dir );
+  }
+  else {
+    path = g_build_filename( sync->destination_dir, directory, NULL );
+  }
+
+  g_free( directory );
+
+  return( path );
+}
+
+/* Create the directory @output, from output_for(), goes in. That can be
+ * below the source's own, eg. for "thumbs/tn_%s.jpg".
+ */
+static void
+output_make_directory( Sync *sync, const char *output )
+{
+  char *path = g_build_filename( sync->destination_dir, output, NULL );
+  char *directory = g_path_get_dirname( path );
+
+  g_mkdir_with_parents( directory, 0755 );
+
+  g_free( directory );
+  g_free( path );
+}
+
+/* output_format is pasted through printf, so any '%' in the directory part
+ * must be doubled.
+ */
+static char *
+output_format_for( Sync *sync, const char *directory )
+{
+  GString *format = g_string_new( NULL );
+  const char *p;
+
+  for( p = directory; *p; p++ ) {
+    if( *p == '%' ) {
+      g_string_append_c( format, '%' );
+    }
+    g_string_append_c( format, *p );
+  }
+  g_string_append_c( format, G_DIR_SEPARATOR );
+  g_string_append( format, sync->options.output_format );
+
+  return( g_string_free( format, FALSE ) );
+}
+
+/* Where the output for @relative goes, relative to the destination.
+ */
+static char *
+output_for( Sync *sync, const char *relative )
+{
+  char *name = thumbnail_output_name( sync->options.output_format, relative );
+  char *parent;
+  char *output;
+
+  if( !name ) {
+    return( NULL );
+  }
+
+  /* The name less any save options.
+   */
+  if( strrchr( name, '[' ) ) {
+    *strrchr( name, '[' ) = '\0';
+  }
+
+  parent = g_path_get_dirname( relative );
+  output = strcmp( parent, "." ) == 0 ?
+    g_strdup( name ) : g_build_filename( parent, name, NULL );
+
+  g_free( parent );
+  g_free( name );
+
+  return( output );
+}
+
+/* Claim @output for @relative for this pass, FALSE if another source
+ * already has it. Call with the lock held.
+ */
+static gboolean
+claim_output( Sync *sync, const char *output, const char *relative )
+{
+  const char *owner;
+
+  if( !*output ) {
+    return( TRUE );
+  }
+
+  if( (owner = g_hash_table_lookup( sync->claims, output )) ) {
+    if( strcmp( owner, relative ) == 0 ) {
+      return( TRUE );
+    }
+
+    fprintf( stderr, "%s: same output %s as %s, rename one of them\n", relative, output, owner );
+    return( FALSE );
+  }
+
+  g_hash_table_insert( sync->claims, g_strdup( output ), g_strdup( relative ) );
+
+  return( TRUE );
+}
+
+static void
+remove_output( Sync *sync, const char *output )
+{
+  char *path;
+
+  if( !output || !*output ) {
+    return;
+  }
+
+  path = g_build_filename( sync->destination_dir, output, NULL );
+  if( unlink( path ) && errno != ENOENT ) {
+    perror( path );
+  }
+  g_free( path );
+}
+
+static void
+sync_job( gpointer data, gpointer user_data )
+{
+  SyncJob *job = (SyncJob *) data;
+  Sync *sync = job->sync;
+  char *filename = g_build_filename( sync->source_dir, job->relative, NULL );
+  ThumbnailOptions options = sync->options;
+  ThumbnailResult result = { 0 };
+  SyncEntry *entry;
+  char *old_output = NULL;
+  char *output = NULL;
+  guint64 content_hash;
+  gboolean same = FALSE;
+
+  if( hash_file( filename, &content_hash ) ) {
+    perror( filename );
+    g_mutex_lock( &sync->lock );
+    sync->failed += 1;
+    g_mutex_unlock( &sync->lock );
+    g_free( filename );
+    g_free( job->relative );
+    g_free( job );
+    return;
+  }
+
+  /* Touched but not changed. If its output clashes with another source's,
+   * forget it, so it's made again once the clash is gone.
+   */
+  g_mutex_lock( &sync->lock );
+  if( (entry = g_hash_table_lookup( sync->manifest, job->relative )) &&
+    entry->content_hash == content_hash &&
+    entry->options_hash == sync->options_hash ) {
+    same = TRUE;
+
+    if( claim_output( sync, entry->output, job->relative ) ) {
+      entry->mtime = job->mtime;
+      entry->size = job->size;
+      sync->unchanged += 1;
+    }
+    else {
+      g_hash_table_remove( sync->manifest, job->relative );
+      sync->failed += 1;
+    }
+  }
+  g_mutex_unlock( &sync->lock );
+
+  if( !same ) {
+    int failed = 0;
+
+    if( thumbnail_is_image( filename ) ) {
+      gboolean claimed;
+
+      output = output_for( sync, job->relative );
+
+      g_mutex_lock( &sync->lock );
+      if( !(claimed = output && claim_output( sync, output, job->relative )) ) {
+        g_hash_table_remove( sync->manifest, job->relative );
+      }
+      g_mutex_unlock( &sync->lock );
+
+      if( claimed ) {
+        VipsObject *process = VIPS_OBJECT( vips_image_new() );
+        ThumbnailSource source = { filename, NULL, 0 };
+        char *directory = output_directory_for( sync, job->relative );
+        char *format = output_format_for( sync, directory );
+
+        output_make_directory( sync, output );
+        options.output_format = format;
+
+        /* The job logs why it failed.
+         */
+        if( thumbnail_process_source( process, source, options, &result ) ) {
+          failed = 1;
+        }
+
+        g_object_unref( process );
+        g_free( directory );
+        g_free( format );
+      }
+      else {
+        failed = 1;
+      }
+    }
+    else {
+      /* Not an image, remember that so we don't sniff it every time.
+       */
+      output = g_strdup( "" );
+    }
+
+    g_mutex_lock( &sync->lock );
+    if( failed ) {
+      sync->failed += 1;
+    }
+    else {
+      if( !(entry = g_hash_table_lookup( sync->manifest, job->relative )) ) {
+        entry = g_new0( SyncEntry, 1 );
+        g_hash_table_replace( sync->manifest, g_strdup( job->relative ), entry );
+      }
+      else if( strcmp( entry->output, output ) != 0 ) {
+        old_output = entry->output;
+        entry->output = NULL;
+      }
+
+      /* The output name can change with the options. The old one may be
+       * another source's output now.
+       */
+      if( old_output &&
+        g_hash_table_contains( sync->claims, old_output ) ) {
+        VIPS_FREE( old_output );
+      }
+
+      g_free( entry->output );
+      entry->output = output;
+      output = NULL;
+      entry->mtime = job->mtime;
+      entry->size = job->size;
+      entry->content_hash = content_hash;
+      entry->options_hash = sync->options_hash;
+      entry->seen = TRUE;
+      sync->processed += 1;
+    }
+    g_mutex_unlock( &sync->lock );
+
+    remove_output( sync, old_output );
+    g_free( old_output );
+  }
+
+  thumbnail_result_clear( &result );
+  g_free( output );
+  g_free( filename );
+  g_free( job->relative );
+  g_free( job );
+}
+
+/* Walk the tree, claiming the outputs of sources that haven't changed and
+ * adding the rest to @jobs. Nothing runs until the walk is done, so those
+ * claims are in before any job can make a clashing output.
+ */
+static void
+sync_walk( Sync *sync, GSList **jobs, const char *relative )
+{
+  char *directory = g_build_filename( sync->source_dir, relative, NULL );
+  const char *name;
+  GDir *dir;
+
+  if( !(dir = g_dir_open( directory, 0, NULL )) ) {
+    g_free( directory );
+    return;
+  }
+
+#ifdef __linux__
+  if( sync->inotify_fd >= 0 ) {
+    inotify_add_watch( sync->inotify_fd, directory,
+      IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO );
+  }
+#endif /*__linux__*/
+
+  while( (name = g_dir_read_name( dir )) ) {
+    char *path;
+    char *child;
+    struct stat st;
+
+    /* Skip dot files, including our own manifest.
+     */
+    if( name[0] == '.' ) {
+      continue;
+    }
+
+    path = g_build_filename( directory, name, NULL );
+    child = *relative ? g_build_filename( relative, name, NULL ) : g_strdup( name );
+
+    if( stat( path, &st ) ) {
+      /* Dangling link, or gone since we listed it.
+       */
+    }
+    else if( S_ISDIR( st.st_mode ) ) {
+      char real[PATH_MAX];
+
+      /* Don't walk into our own output if it's under the source.
+       */
+      if( !realpath( path, real ) || strcmp( real, sync->destination_real ) != 0 ) {
+        sync_walk( sync, jobs, child );
+      }
+    }
+    else if( S_ISREG( st.st_mode ) ) {
+      SyncEntry *entry;
+      gboolean current;
+
+      g_mutex_lock( &sync->lock );
+      entry = g_hash_table_lookup( sync->manifest, child );
+      if( entry ) {
+        entry->seen = TRUE;
+      }
+      current = entry &&
+        entry->mtime == stat_mtime( &st ) &&
+        entry->size == (gint64) st.st_size &&
+        entry->options_hash == sync->options_hash;
+      if( current ) {
+        if( claim_output( sync, entry->output, child ) ) {
+          sync->unchanged += 1;
+        }
+        else {
+          g_hash_table_remove( sync->manifest, child );
+          sync->failed += 1;
+        }
+      }
+      g_mutex_unlock( &sync->lock );
+
+      if( !current ) {
+        SyncJob *job = g_new( SyncJob, 1 );
+
+        job->sync = sync;
+        job->relative = child;
+        job->mtime = stat_mtime( &st );
+        job->size = st.st_size;
+        child = NULL;
+
+        *jobs = g_slist_prepend( *jobs, job );
+      }
+    }
+
+    g_free( path );
+    g_free( child );
+  }
+
+  g_dir_close( dir );
+  g_free( directory );
+}
+
+static gboolean
+remove_unseen( gpointer key, gpointer value, gpointer user_data )
+{
+  SyncEntry *entry = (SyncEntry *) value;
+  Sync *sync = (Sync *) user_data;
+
+  if( entry->seen ) {
+    entry->seen = FALSE;
+    return( FALSE );
+  }
+
+  /* Unless a source with the same output name has it.
+   */
+  if( !g_hash_table_contains( sync->claims, entry->output ) ) {
+    remove_output( sync, entry->output );
+  }
+  sync->removed += 1;
+
+  return( TRUE );
+}
+
+static int
+sync_pass( Sync *sync, int n_jobs )
+{
+  GThreadPool *pool;
+  GSList *jobs = NULL;
+  GSList *p;
+  gint64 start = g_get_monotonic_time();
+
+  sync->processed = 0;
+  sync->unchanged = 0;
+  sync->removed = 0;
+  sync->failed = 0;
+
+  sync->claims = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, g_free );
+
+  sync_walk( sync, &jobs, "" );
+
+  pool = g_thread_pool_new( sync_job, NULL, n_jobs > 0 ? n_jobs : g_get_num_processors(), FALSE, NULL );
+  jobs = g_slist_reverse( jobs );
+  for( p = jobs; p; p = p->next ) {
+    g_thread_pool_push( pool, p->data, NULL );
+  }
+  g_slist_free( jobs );
+
+  /* Wait for the queue to drain.
+   */
+  g_thread_pool_free( pool, FALSE, TRUE );
+
+  g_hash_table_foreach_remove( sync->manifest, remove_unseen, sync );
+  g_hash_table_destroy( sync->claims );
+  sync->claims = NULL;
+
+  printf( "%s: %d processed, %d unchanged, %d removed, %d failed in %.2fs\n",
+    sync->source_dir, sync->processed, sync->unchanged, sync->removed, sync->failed,
+    (g_get_monotonic_time() - start) / 1000000.0 );
+  fflush( stdout );
+
+  if( manifest_save( sync ) ) {
+    return( -1 );
+  }
+
+  return( sync->failed ? -1 : 0 );
+}
+
+#ifdef __linux__
+/* Block until the tree changes, then wait for it to go quiet for a moment
+ * so a burst of events turns into a single pass.
+ */
+static int
+sync_wait( Sync *sync )
+{
+  char buf[4096];
+  struct pollfd fds = { sync->inotify_fd, POLLIN, 0 };
+  int timeout = -1;
+
+  for(;;) {
+    int ready = poll( &fds, 1, timeout );
+
+    if( ready < 0 ) {
+      if( errno == EINTR ) {
+        continue;
+      }
+      perror( "poll" );
+      return( -1 );
+    }
+
+    if( ready == 0 ) {
+      return( 0 );
+    }
+
+    if( read( sync->inotify_fd, buf, sizeof( buf ) ) < 0 && errno != EINTR ) {
+      perror( "inotify" );
+      return( -1 );
+    }
+
+    timeout = 250;
+  }
+}
+#endif /*__linux__*/
+
+int
+hangnail_sync( const char *source_dir, const char *destination_dir, ThumbnailOptions options, int jobs, gboolean watch )
+{
+  char real[PATH_MAX];
+  char *name;
+  Sync sync;
+  int status;
+
+  if( options.output_format[0] == '.' || g_path_is_absolute( options.output_format ) ) {
+    fprintf( stderr, "--sync needs an output file name relative to the destination, not \"%s\"\n", options.output_format );
+    return( 1 );
+  }
+
+  /* We don't track pyramids or extra outputs in the manifest.
+   */
+  if( options.pyramid_output ) {
+    fprintf( stderr, "--sync can't write pyramids\n" );
+    return( 1 );
+  }
+  if( options.output_formats ) {
+    fprintf( stderr, "--sync can only write one output format\n" );
+    return( 1 );
+  }
+
+  /* We name outputs ahead of the jobs, so check the name can be used.
+   */
+  if( !(name = thumbnail_output_name( options.output_format, "" )) ) {
+    name = thumbnail_error_take();
+    fprintf( stderr, "%s\n", name );
+    g_free( name );
+    return( 1 );
+  }
+  g_free( name );
+
+  if( g_mkdir_with_parents( destination_dir, 0755 ) || !realpath( destination_dir, real ) ) {
+    perror( destination_dir );
+    return( 1 );
+  }
+
+  memset( &sync, 0, sizeof( sync ) );
+  sync.source_dir = source_dir;
+  sync.destination_dir = destination_dir;
+  sync.destination_real = real;
+  sync.manifest_path = g_build_filename( destination_dir, HANGNAIL_MANIFEST, NULL );
+  sync.options = options;
+  sync.options_hash = hash_options( options );
+  sync.manifest = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, sync_entry_free );
+  g_mutex_init( &sync.lock );
+
+#ifdef __linux__
+  sync.inotify_fd = -1;
+  if( watch && (sync.inotify_fd = inotify_init()) < 0 ) {
+    perror( "inotify" );
+    return( 1 );
+  }
+#else
+  if( watch ) {
+    fprintf( stderr, "--watch is only supported on Linux\n" );
+    return( 1 );
+  }
+#endif /*__linux__*/
+
+  manifest_load( &sync );
+
+  status = sync_pass( &sync, jobs );
+
+#ifdef __linux__
+  while( watch && !sync_wait( &sync ) ) {
+    status = sync_pass( &sync, jobs );
+  }
+
+  if( sync.inotify_fd >= 0 ) {
+    close( sync.inotify_fd );
+  }
+#endif /*__linux__*/
+
+  g_hash_table_destroy( sync.manifest );
+  g_mutex_clear( &sync.lock );
+  g_free( sync.manifest_path );
+
+  return( status ? 1 : 0 );
+}
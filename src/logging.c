@@ -0,0 +1,150 @@
+/* Per-job logging and error capture.
+ *
+ * Jobs used to log through vips_info(), which formats every message whether
+ * or not anyone is listening, and report errors through the process-wide
+ * vips error buffer, where concurrent jobs would mix or clear each other's
+ * text. Now each job can carry its own ThumbnailLog, and errors we raise
+ * ourselves go to a buffer per thread, which only that thread's job takes.
+ */
+
+#include "logging.h"
+
+/* Longest message we format, anything longer is truncated.
+ */
+#define LOG_MAX_MESSAGE (1024)
+
+static const char *level_names[] = {
+  "debug", "info", "warn", "error", "none"
+};
+
+static void
+log_stderr( ThumbnailLogLevel level, const char *context, const char *event, const char *message, void *user_data )
+{
+  fprintf( stderr, "%s: %s: %s: %s\n", context, level_names[level], event, message );
+}
+
+ThumbnailLog thumbnail_log_default = { THUMBNAIL_LOG_WARN, log_stderr, NULL };
+
+static GMutex error_lock;
+
+static void
+error_free( gpointer data )
+{
+  g_string_free( (GString *) data, TRUE );
+}
+
+static GPrivate error_key = G_PRIVATE_INIT( error_free );
+
+static GString *
+error_get( void )
+{
+  GString *errors;
+
+  if( !(errors = g_private_get( &error_key )) ) {
+    errors = g_string_new( NULL );
+    g_private_set( &error_key, errors );
+  }
+
+  return( errors );
+}
+
+/* Jobs can log from more than one thread, eg. while encoding several 
+ * outputs, so sinks are only ever called one record at a time.
+ */
+static GMutex log_lock;
+
+void
+thumbnail_log_init( void )
+{
+  if( g_getenv( "VIPS_INFO" ) ) {
+    thumbnail_log_default.level = THUMBNAIL_LOG_DEBUG;
+  }
+}
+
+void
+thumbnail_log_message( ThumbnailLog *log, ThumbnailLogLevel level, const char *context, const char *event, const char *fmt, ... )
+{
+  char message[LOG_MAX_MESSAGE];
+  va_list ap;
+
+  if( !log ) {
+    log = &thumbnail_log_default;
+  }
+
+  if( !log->fn ) {
+    return;
+  }
+
+  va_start( ap, fmt );
+  vsnprintf( message, sizeof( message ), fmt, ap );
+  va_end( ap );
+
+  g_mutex_lock( &log_lock );
+  log->fn( level, context ? context : "cuticle", event, message, log->user_data );
+  g_mutex_unlock( &log_lock );
+}
+
+int
+thumbnail_log_level_parse( const char *name )
+{
+  int i;
+
+  for( i = 0; i < VIPS_NUMBER( level_names ); i++ ) {
+    if( g_ascii_strcasecmp( name, level_names[i] ) == 0 ) {
+      return( i );
+    }
+  }
+
+  return( -1 );
+}
+
+const char *
+thumbnail_log_level_name( ThumbnailLogLevel level )
+{
+  return( level_names[VIPS_CLIP( 0, level, THUMBNAIL_LOG_NONE )] );
+}
+
+void
+thumbnail_error( const char *domain, const char *fmt, ... )
+{
+  GString *errors = error_get();
+  va_list ap;
+
+  if( domain ) {
+    g_string_append_printf( errors, "%s: ", domain );
+  }
+
+  va_start( ap, fmt );
+  g_string_append_vprintf( errors, fmt, ap );
+  va_end( ap );
+
+  g_string_append_c( errors, '\n' );
+}
+
+void
+thumbnail_error_clear( void )
+{
+  g_string_truncate( error_get(), 0 );
+}
+
+char *
+thumbnail_error_take( void )
+{
+  GString *errors = error_get();
+  char *text;
+
+  if( errors->len ) {
+    text = g_strdup( errors->str );
+    g_string_truncate( errors, 0 );
+  }
+  else {
+    g_mutex_lock( &error_lock );
+    text = g_strdup( vips_error_buffer() );
+    vips_error_clear();
+    g_mutex_unlock( &error_lock );
+  }
+
+  g_strchomp( text );
+
+  return( text );
+}
@@ -0,0 +1,84 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <vips/vips.h>
+
+typedef enum {
+  THUMBNAIL_LOG_DEBUG,    // each step of the pipeline
+  THUMBNAIL_LOG_INFO,     // one line per output written
+  THUMBNAIL_LOG_WARN,     // worked, but not as asked
+  THUMBNAIL_LOG_ERROR,    // a job failed
+  THUMBNAIL_LOG_NONE
+} ThumbnailLogLevel;
+
+/* A log record: event is a short fixed tag for what happened, like "shrink"
+ * or "save", and message is the formatted detail.
+ */
+typedef void (*ThumbnailLogFn)( ThumbnailLogLevel level, const char *context, const char *event, const char *message, void *user_data );
+
+/* Where a job's log goes. Records below level are dropped before anything
+ * is formatted. fn is called one record at a time, but not always from the
+ * same thread.
+ */
+typedef struct {
+  ThumbnailLogLevel level;
+  ThumbnailLogFn fn;
+  void *user_data;
+} ThumbnailLog;
+
+/* Used by jobs with no log of their own. Prints to stderr, WARN and up
+ * unless VIPS_INFO is set, in which case everything.
+ */
+extern ThumbnailLog thumbnail_log_default;
+
+#define THUMBNAIL_LOG_ENABLED( LOG, LEVEL ) \
+  ((LEVEL) >= ((LOG) ? (LOG) : &thumbnail_log_default)->level)
+
+/* Log to the job's sink. The level test comes first, so the arguments
+ * aren't evaluated and nothing is formatted for levels nobody wants.
+ */
+#define thumbnail_log( OPTIONS, LEVEL, EVENT, ... ) do { \
+  if( THUMBNAIL_LOG_ENABLED( (OPTIONS).log, (LEVEL) ) ) \
+    thumbnail_log_message( (OPTIONS).log, (LEVEL), (OPTIONS).context_name, (EVENT), __VA_ARGS__ ); \
+} while( 0 )
+
+void
+thumbnail_log_message( ThumbnailLog *log, ThumbnailLogLevel level, const char *context, const char *event, const char *fmt, ... );
+
+void
+thumbnail_log_init( void );
+
+/* "debug", "info", "warn", "error" or "none", -1 if unknown.
+ */
+int
+thumbnail_log_level_parse( const char *name );
+
+const char *
+thumbnail_log_level_name( ThumbnailLogLevel level );
+
+/* Raise an error for the job on this thread, like vips_error(), but into a
+ * buffer of this thread's own, so no other job can see or clear it. Use
+ * this, not vips_error(), for anything we detect ourselves.
+ */
+void
+thumbnail_error( const char *domain, const char *fmt, ... )
+  G_GNUC_PRINTF( 2, 3 );
+
+/* Drop this thread's errors, leaving the vips buffer alone.
+ */
+void
+thumbnail_error_clear( void );
+
+/* Take and clear this thread's errors. If there are none the failure was
+ * raised inside libvips, so take and clear its buffer instead, under a lock.
+ * Free the result with g_free(), it's never NULL.
+ *
+ * libvips keeps its own errors in one process-wide buffer and doesn't say
+ * which thread raised them, so that text can't be told apart per job. Check
+ * what we can before calling into libvips, so that only genuine libvips
+ * failures ever reach it.
+ */
+char *
+thumbnail_error_take( void );
+
+#endif /*LOGGING_H*/
@@ -0,0 +1,276 @@
+/* Buffer pools.
+ *
+ * Every job used to malloc its encoded output and its rendered thumbnail,
+ * and free them again at the end. With many small jobs a second that churn
+ * shows up in profiles as allocator time and page faults. Now those come
+ * from pools that keep freed buffers for the next job.
+ */
+
+#include <string.h>
+
+#include "pool.h"
+
+#define POOL_N_CLASSES (THUMBNAIL_POOL_MAX_SHIFT - THUMBNAIL_POOL_MIN_SHIFT + 1)
+#define POOL_CLASS_SIZE( C ) ((size_t) 1 << (THUMBNAIL_POOL_MIN_SHIFT + (C)))
+
+/* Every buffer has this in front of it, padded so the data stays 16-byte
+ * aligned. size_class is -1 for buffers too big to pool.
+ */
+typedef struct _PoolBlock {
+  struct _PoolBlock *next;
+  int size_class;
+} PoolBlock;
+
+#define POOL_HEADER (16)
+
+G_STATIC_ASSERT( sizeof( PoolBlock ) <= POOL_HEADER );
+
+#define POOL_BLOCK( DATA ) ((PoolBlock *) ((char *) (DATA) - POOL_HEADER))
+
+static GMutex pool_lock;
+static PoolBlock *free_lists[POOL_N_CLASSES];
+static size_t held_bytes = 0;
+static size_t pool_budget = THUMBNAIL_POOL_BUDGET;
+static guint64 pool_hits = 0;
+static guint64 pool_misses = 0;
+
+static int
+pool_class( size_t length )
+{
+  int size_class;
+
+  for( size_class = 0; size_class < POOL_N_CLASSES; size_class++ ) {
+    if( length <= POOL_CLASS_SIZE( size_class ) ) {
+      return( size_class );
+    }
+  }
+
+  return( -1 );
+}
+
+static size_t
+pool_capacity( void *data )
+{
+  return( POOL_CLASS_SIZE( POOL_BLOCK( data )->size_class ) );
+}
+
+void *
+thumbnail_pool_alloc( size_t length )
+{
+  int size_class = pool_class( length );
+  PoolBlock *block = NULL;
+
+  g_mutex_lock( &pool_lock );
+  if( size_class >= 0 &&
+    (block = free_lists[size_class]) ) {
+    free_lists[size_class] = block->next;
+    held_bytes -= POOL_CLASS_SIZE( size_class );
+    pool_hits += 1;
+  }
+  else {
+    pool_misses += 1;
+  }
+  g_mutex_unlock( &pool_lock );
+
+  if( !block ) {
+    block = g_malloc( POOL_HEADER +
+      (size_class >= 0 ? POOL_CLASS_SIZE( size_class ) : length) );
+    block->size_class = size_class;
+  }
+
+  return( (char *) block + POOL_HEADER );
+}
+
+void
+thumbnail_pool_free( void *data )
+{
+  PoolBlock *block;
+
+  if( !data ) {
+    return;
+  }
+
+  block = POOL_BLOCK( data );
+
+  if( block->size_class >= 0 ) {
+    size_t size = POOL_CLASS_SIZE( block->size_class );
+
+    g_mutex_lock( &pool_lock );
+    if( held_bytes + size <= pool_budget ) {
+      block->next = free_lists[block->size_class];
+      free_lists[block->size_class] = block;
+      held_bytes += size;
+      block = NULL;
+    }
+    g_mutex_unlock( &pool_lock );
+  }
+
+  g_free( block );
+}
+
+void
+thumbnail_pool_set_budget( size_t bytes )
+{
+  g_mutex_lock( &pool_lock );
+  pool_budget = bytes;
+  g_mutex_unlock( &pool_lock );
+}
+
+void
+thumbnail_pool_stats( ThumbnailPoolStats *stats )
+{
+  g_mutex_lock( &pool_lock );
+  stats->hits = pool_hits;
+  stats->misses = pool_misses;
+  stats->held_bytes = held_bytes;
+  g_mutex_unlock( &pool_lock );
+}
+
+/* The encoder writes a chunk at a time into a pool buffer, and we trade up
+ * a size class when it fills.
+ */
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} PoolSink;
+
+static gint64
+pool_sink_write( VipsTargetCustom *target, const void *data, gint64 length, PoolSink *sink )
+{
+  if( sink->length + length > sink->capacity ) {
+    char *bigger = thumbnail_pool_alloc( VIPS_MAX( sink->capacity * 2, sink->length + length ) );
+
+    memcpy( bigger, sink->data, sink->length );
+    thumbnail_pool_free( sink->data );
+    sink->data = bigger;
+    sink->capacity = pool_capacity( bigger );
+  }
+
+  memcpy( sink->data + sink->length, data, length );
+  sink->length += length;
+
+  return( length );
+}
+
+static void *
+saver_find_sub( VipsForeignSaveClass *save_class, const char *suffix, const char *postfix )
+{
+  VipsObjectClass *object_class = VIPS_OBJECT_CLASS( save_class );
+  VipsForeignClass *foreign_class = VIPS_FOREIGN_CLASS( save_class );
+  const char **p;
+
+  if( (postfix && !vips_ispostfix( object_class->nickname, postfix )) ||
+    !foreign_class->suffs ) {
+    return( NULL );
+  }
+
+  for( p = foreign_class->suffs; *p; p++ ) {
+    if( g_ascii_strcasecmp( *p, suffix ) == 0 ) {
+      return( save_class );
+    }
+  }
+
+  return( NULL );
+}
+
+const char *
+thumbnail_saver_find( const char *format, const char *postfix )
+{
+  char name[FILENAME_MAX];
+  const char *suffix;
+  char *p;
+  VipsForeignSaveClass *save_class;
+
+  g_strlcpy( name, format, FILENAME_MAX );
+  if( (p = strrchr( name, '[' )) ) {
+    *p = '\0';
+  }
+
+  if( !(suffix = strrchr( name, '.' )) ) {
+    return( NULL );
+  }
+
+  save_class = (VipsForeignSaveClass *) vips_foreign_map( "VipsForeignSave", 
+    (VipsSListMap2Fn) saver_find_sub, (void *) suffix, (void *) postfix );
+
+  return( save_class ? G_OBJECT_CLASS_NAME( save_class ) : NULL );
+}
+
+int
+thumbnail_pool_encode( VipsImage *im, const char *format, void **data, size_t *length )
+{
+  VipsTargetCustom *target;
+  PoolSink sink;
+  int status;
+
+  /* Not every saver can write to a target, and libvips before 8.9 has
+   * none.
+   */
+  if( !thumbnail_saver_find( format, "_target" ) ) {
+    void *buf;
+
+    if( vips_image_write_to_buffer( im, format, &buf, length, NULL ) ) {
+      return( -1 );
+    }
+
+    *data = thumbnail_pool_alloc( *length );
+    memcpy( *data, buf, *length );
+    g_free( buf );
+
+    return( 0 );
+  }
+
+  /* Compressed thumbnails are mostly well under a tenth of the pixels.
+   */
+  sink.data = thumbnail_pool_alloc( VIPS_IMAGE_SIZEOF_IMAGE( im ) / 8 );
+  sink.length = 0;
+  sink.capacity = pool_capacity( sink.data );
+
+  target = vips_target_custom_new();
+  g_signal_connect( target, "write", G_CALLBACK( pool_sink_write ), &sink );
+  status = vips_image_write_to_target( im, format, VIPS_TARGET( target ), NULL );
+  VIPS_UNREF( target );
+
+  if( status ) {
+    thumbnail_pool_free( sink.data );
+    return( -1 );
+  }
+
+  *data = sink.data;
+  *length = sink.length;
+
+  return( 0 );
+}
+
+static void
+pool_image_postclose( VipsImage *im, void *data )
+{
+  thumbnail_pool_free( data );
+}
+
+VipsImage *
+thumbnail_pool_image( VipsImage *im )
+{
+  size_t size = VIPS_IMAGE_SIZEOF_IMAGE( im );
+  VipsImage *memory;
+  void *data;
+
+  /* Coded images have no fixed pixel size, let vips size them.
+   */
+  if( im->Coding != VIPS_CODING_NONE ) {
+    return( vips_image_new_memory() );
+  }
+
+  data = thumbnail_pool_alloc( size );
+
+  if( !(memory = vips_image_new_from_memory( data, size,
+    im->Xsize, im->Ysize, im->Bands, im->BandFmt )) ) {
+    thumbnail_pool_free( data );
+    return( NULL );
+  }
+
+  g_signal_connect( memory, "postclose", G_CALLBACK( pool_image_postclose ), data );
+
+  return( memory );
+}
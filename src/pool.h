@@ -0,0 +1,57 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <vips/vips.h>
+
+/* Encoded thumbnails and rendered pixels come from size-class pools, powers
+ * of two from 4KB to 16MB. Freed buffers go back on their class's free list,
+ * up to THUMBNAIL_POOL_BUDGET bytes in all, so a steady stream of similar
+ * jobs stops calling malloc. Bigger buffers aren't pooled.
+ */
+#define THUMBNAIL_POOL_MIN_SHIFT (12)
+#define THUMBNAIL_POOL_MAX_SHIFT (24)
+#define THUMBNAIL_POOL_BUDGET (64 * 1024 * 1024)
+
+/* hits and misses count pool allocations that did and didn't find a free
+ * buffer, held_bytes what the free lists hold now.
+ */
+typedef struct {
+  guint64 hits;
+  guint64 misses;
+  size_t held_bytes;
+} ThumbnailPoolStats;
+
+/* At least @length bytes, free with thumbnail_pool_free().
+ */
+void *
+thumbnail_pool_alloc( size_t length );
+
+void
+thumbnail_pool_free( void *data );
+
+void
+thumbnail_pool_set_budget( size_t bytes );
+
+void
+thumbnail_pool_stats( ThumbnailPoolStats *stats );
+
+/* The class name of the saver for @format, like "VipsForeignSaveJpegTarget",
+ * or NULL. With @postfix, only savers whose nickname ends with it, like
+ * "_target". Unlike vips_foreign_find_save(), a miss leaves nothing in the
+ * error buffer, so it's safe to ask speculatively while other jobs run.
+ */
+const char *
+thumbnail_saver_find( const char *format, const char *postfix );
+
+/* Like vips_image_write_to_buffer(), but @data is from the pool.
+ */
+int
+thumbnail_pool_encode( VipsImage *im, const char *format, void **data, size_t *length );
+
+/* A memory image the size and format of @im, its pixels from the pool, to
+ * render @im into.
+ */
+VipsImage *
+thumbnail_pool_image( VipsImage *im );
+
+#endif /*POOL_H*/
@@ -1,4 +1,5 @@
 #include "thumbnail.h"
+#include "analytics.h"
 
 static VipsAngle 
 get_angle( VipsImage *im )
@@ -38,7 +39,7 @@ get_angle( VipsImage *im )
 static int
 calculate_shrink( VipsImage *im, double *residual, double* full_shrink, ThumbnailOptions options )
 {
-  int thumbnail_width = options.thumbnail_height;
+  int thumbnail_width = options.thumbnail_width;
   int thumbnail_height = options.thumbnail_height;
   gboolean rotate_image = options.rotate_image;
   gboolean crop_image = options.crop_image;
@@ -53,7 +54,7 @@ calculate_shrink( VipsImage *im, double *residual, double* full_shrink, Thumbnai
     thumbnail_height = height;
   }
 
-  vips_info(options.context_name, "O(%d,%d) T(%d,%d) R(%d)", width, height, thumbnail_width, thumbnail_height, options.resize_constraint);
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "shrink", "O(%d,%d) T(%d,%d) R(%d)", width, height, thumbnail_width, thumbnail_height, options.resize_constraint );
 
   /* Calculate the horizontal and vertical shrink we'd need to fit the
    * image to the bounding box, and pick the biggest.
@@ -67,7 +68,7 @@ calculate_shrink( VipsImage *im, double *residual, double* full_shrink, Thumbnai
     VIPS_MIN( horizontal, vertical ) : 
     VIPS_MAX( horizontal, vertical ); 
 
-  vips_info(options.context_name, "Shrink Factor: %f", factor);
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "shrink", "Shrink Factor: %f", factor );
 
   /* If the shrink factor is <= 1.0, we need to zoom rather than shrink.
    * Just set the factor to 1 in this case.
@@ -124,34 +125,134 @@ thumbnail_find_jpegshrink( VipsImage *im, ThumbnailOptions options )
     return( 1 );
 }
 
+/* Does @loader take "page" and "n", ie. can it load several pages or 
+ * frames stacked top to bottom.
+ */
+static gboolean
+thumbnail_loader_paged( const char *loader )
+{
+  GType type = g_type_from_name( loader );
+  GObjectClass *class;
+  gboolean paged;
+
+  if( !type ) {
+    return( FALSE );
+  }
+
+  class = G_OBJECT_CLASS( g_type_class_ref( type ) );
+  paged = g_object_class_find_property( class, "page" ) &&
+    g_object_class_find_property( class, "n" );
+  g_type_class_unref( class );
+
+  return( paged );
+}
+
+static void *
+thumbnail_is_image_sub( VipsForeignLoadClass *load_class, const char *filename )
+{
+  VipsObjectClass *object_class = VIPS_OBJECT_CLASS( load_class );
+  VipsForeignClass *foreign_class = VIPS_FOREIGN_CLASS( load_class );
+
+  if( vips_ispostfix( object_class->nickname, "_buffer" ) ||
+    vips_ispostfix( object_class->nickname, "_source" ) ) {
+    return( NULL );
+  }
+
+  if( load_class->is_a ) {
+    return( load_class->is_a( filename ) ? load_class : NULL );
+  }
+
+  return( foreign_class->suffs &&
+    vips_filename_suffix_match( filename, foreign_class->suffs ) ? 
+      load_class : NULL );
+}
+
+/* The same search as vips_foreign_find_load(), less the error for a miss.
+ */
+gboolean
+thumbnail_is_image( const char *filename )
+{
+  return( vips_foreign_map( "VipsForeignLoad", 
+    (VipsSListMap2Fn) thumbnail_is_image_sub, (void *) filename, NULL ) != NULL );
+}
+
+/* The height of a frame if @im is a stack of more than one, otherwise 0.
+ */
+static int
+thumbnail_page_height( VipsImage *im )
+{
+  int page_height;
+
+  if( !vips_image_get_typeof( im, PAGE_HEIGHT ) ||
+    vips_image_get_int( im, PAGE_HEIGHT, &page_height ) ||
+    page_height <= 0 ||
+    page_height >= im->Ysize ||
+    im->Ysize % page_height != 0 ) {
+    return( 0 );
+  }
+
+  return( page_height );
+}
+
 /* Open an image, returning the best version of that image for thumbnailing. 
  *
  * libjpeg supports fast shrink-on-read, so if we have a JPEG, we can ask 
  * VIPS to load a lower resolution version.
+ *
+ * Formats with pages or frames load page to page + n_pages, stacked top to
+ * bottom with PAGE_HEIGHT set.
+ *
+ * @shrink is set to the shrink-on-load factor, 1 if the image is full size.
+ *
+ * With pyramid_output, @full is set to the full-size image for the pyramid.
+ * That's a second, streamed load for a JPEG, so the thumbnail keeps its
+ * shrink-on-load. Any other format would be decoded in full twice, so it's 
+ * decoded once to memory, or disc if it's large, and shared.
  */
 static VipsImage *
-thumbnail_open( VipsObject *process, const char *filename, ThumbnailOptions options )
+thumbnail_open( VipsObject *process, ThumbnailSource source, ThumbnailOptions options, int *shrink, VipsImage **full )
 {
   const char *loader;
   VipsImage *im;
 
-  vips_info( options.context_name, "thumbnailing %s", filename );
+  VipsAccess access = options.pyramid_output ? 
+    VIPS_ACCESS_RANDOM : VIPS_ACCESS_SEQUENTIAL;
+
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "load", "thumbnailing %s", source.filename );
+
+  *shrink = 1;
+  *full = NULL;
 
   if( options.linear_processing )
-    vips_info( options.context_name, "linear mode" ); 
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "load", "linear mode" ); 
+
+  if( source.data ) {
+    loader = vips_foreign_find_load_buffer( source.data, source.length );
+  }
+  else {
+    loader = vips_foreign_find_load( source.filename );
+  }
 
-  if( !(loader = vips_foreign_find_load( filename )) ) {
+  if( !loader ) {
     return( NULL );
   }
 
-  vips_info( options.context_name, "selected loader is %s", loader ); 
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "load", "selected loader is %s", loader ); 
 
-  if( strcmp( loader, "VipsForeignLoadJpegFile" ) == 0 ) {
+  if( strcmp( loader, "VipsForeignLoadJpegFile" ) == 0 ||
+    strcmp( loader, "VipsForeignLoadJpegBuffer" ) == 0 ) {
     int jpegshrink;
 
     /* This will just read in the header and is quick.
      */
-    if( !(im = vips_image_new_from_file( filename )) ) {
+    if( source.data ) {
+      im = vips_image_new_from_buffer( (void *) source.data, source.length, "", NULL );
+    }
+    else {
+      im = vips_image_new_from_file( source.filename );
+    }
+
+    if( !im ) {
       return( NULL );
     }
 
@@ -159,22 +260,99 @@ thumbnail_open( VipsObject *process, const char *filename, ThumbnailOptions opti
 
     g_object_unref( im );
 
-    vips_info( options.context_name, "loading jpeg with factor %d pre-shrink", jpegshrink ); 
+    /* The pyramid streams its own full-size copy.
+     */
+    if( options.pyramid_output ) {
+      thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "load", "loading full-size jpeg for the pyramid" ); 
+
+      if( source.data ) {
+        *full = vips_image_new_from_buffer( (void *) source.data, source.length, "", 
+          "access", VIPS_ACCESS_SEQUENTIAL, NULL );
+      }
+      else if( vips_foreign_load( source.filename, full, "access", VIPS_ACCESS_SEQUENTIAL, NULL ) ) {
+        *full = NULL;
+      }
+
+      if( !*full ) {
+        return( NULL );
+      }
+
+      vips_object_local( process, *full );
+      access = VIPS_ACCESS_SEQUENTIAL;
+    }
+
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "load", "loading jpeg with factor %d pre-shrink", jpegshrink ); 
+
+    *shrink = jpegshrink;
+
+    if( source.data ) {
+      im = vips_image_new_from_buffer( (void *) source.data, source.length, "", 
+        "access", access, "shrink", jpegshrink, NULL );
+    }
+    else if( vips_foreign_load( source.filename, &im, "access", access, "shrink", jpegshrink, NULL ) ) {
+      im = NULL;
+    }
+  }
+  else if( (options.page || options.n_pages != 1) &&
+    thumbnail_loader_paged( loader ) ) {
+    /* Frames are cut out of a stack in any order, so that needs random
+     * access too. Read just the header to see if we have one: a single
+     * page streams like anything else.
+     */
+    if( source.data ) {
+      im = vips_image_new_from_buffer( (void *) source.data, source.length, "", 
+        "page", options.page, "n", options.n_pages, NULL );
+    }
+    else if( vips_foreign_load( source.filename, &im, 
+      "page", options.page, "n", options.n_pages, NULL ) ) {
+      im = NULL;
+    }
 
-    if( vips_foreign_load( filename, &im, "access", VIPS_ACCESS_SEQUENTIAL, "shrink", jpegshrink, NULL ) ) {
+    if( !im ) {
       return( NULL );
     }
+
+    if( thumbnail_page_height( im ) ) {
+      access = VIPS_ACCESS_RANDOM;
+    }
+
+    g_object_unref( im );
+
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "load", "loading %d pages from page %d, %s", 
+      options.n_pages, options.page, access == VIPS_ACCESS_RANDOM ? "random" : "sequential" ); 
+
+    if( source.data ) {
+      im = vips_image_new_from_buffer( (void *) source.data, source.length, "", 
+        "access", access, "page", options.page, "n", options.n_pages, NULL );
+    }
+    else if( vips_foreign_load( source.filename, &im, 
+      "access", access, "page", options.page, "n", options.n_pages, NULL ) ) {
+      im = NULL;
+    }
   }
   else {
     /* All other formats.
      */
-    if( vips_foreign_load( filename, &im, "access", VIPS_ACCESS_SEQUENTIAL, NULL ) ) {
-      return( NULL );
+    if( source.data ) {
+      im = vips_image_new_from_buffer( (void *) source.data, source.length, "", 
+        "access", access, NULL );
     }
+    else if( vips_foreign_load( source.filename, &im, "access", access, NULL ) ) {
+      im = NULL;
+    }
+  }
+
+  if( !im ) {
+    return( NULL );
   }
 
   vips_object_local( process, im );
 
+  if( options.pyramid_output &&
+    !*full ) {
+    *full = im;
+  }
+
   return( im ); 
 }
 
@@ -184,14 +362,22 @@ thumbnail_interpolator( VipsObject *process, VipsImage *in, ThumbnailOptions opt
   double residual;
   VipsInterpolate *interp;
 
+  const char *name;
+
   calculate_shrink( in, &residual, NULL, options );
 
   /* For images smaller than the thumbnail, we upscale with nearest
    * neighbor. Otherwise we makes thumbnails that look fuzzy and awful.
    */
+  name = residual > 1.0 ? "nearest" : options.interpolator;
+
+  if( !vips_type_find( "VipsInterpolate", name ) ) {
+    thumbnail_error( options.context_name, "unknown interpolator \"%s\"", name );
+    return( NULL );
+  }
+
   if( !(interp = VIPS_INTERPOLATE( vips_object_new_from_string( 
-    g_type_class_ref( VIPS_TYPE_INTERPOLATE ), 
-    residual > 1.0 ? "nearest" : options.interpolator ) )) )
+    g_type_class_ref( VIPS_TYPE_INTERPOLATE ), name ) )) )
     return( NULL );
 
   vips_object_local( process, interp );
@@ -200,35 +386,250 @@ thumbnail_interpolator( VipsObject *process, VipsImage *in, ThumbnailOptions opt
 }
 
 /* Some interpolators look a little soft, so we have an optional sharpening
- * stage.
+ * stage. @mask is set to NULL for no sharpening.
  */
-static VipsImage *
-thumbnail_sharpen( VipsObject *process, ThumbnailOptions options )
+static int
+thumbnail_sharpen( VipsObject *process, ThumbnailOptions options, VipsImage **mask )
 {
-  VipsImage *mask;
-
   if( strcmp( options.convolution_mask, "none" ) == 0 ) 
-    mask = NULL; 
+    *mask = NULL; 
   else if( strcmp( options.convolution_mask, "mild" ) == 0 ) {
-    mask = vips_image_new_matrixv( 3, 3,
+    *mask = vips_image_new_matrixv( 3, 3,
       -1.0, -1.0, -1.0,
       -1.0, 32.0, -1.0,
       -1.0, -1.0, -1.0 );
-    vips_image_set_double( mask, "scale", 24 );
+    vips_image_set_double( *mask, "scale", 24 );
   }
-  else
-    if( !(mask = 
-      vips_image_new_from_file( options.convolution_mask )) )
-      vips_error_exit( "unable to load sharpen mask" ); 
+  else {
+    /* We may be running inside a server, so report rather than exit. Check
+     * the file ourselves first, so a bad name doesn't leave an error in
+     * the vips buffer.
+     */
+    if( !g_file_test( options.convolution_mask, G_FILE_TEST_IS_REGULAR ) ||
+      !thumbnail_is_image( options.convolution_mask ) ) {
+      thumbnail_error( options.context_name, "unable to load sharpen mask \"%s\"", options.convolution_mask ); 
+      return( -1 );
+    }
+
+    if( !(*mask = vips_image_new_from_file( options.convolution_mask )) ) 
+      return( -1 );
+  }
+
+  if( *mask )
+    vips_object_local( process, *mask );
+
+  return( 0 );
+}
+
+/* Jobs share the vips worker threads and a memory budget for their scanline
+ * caches. Small jobs take one thread and run in the calling thread, so many
+ * can go side by side. libvips can't cap the threads one image renders
+ * with, so a big job runs on the whole vips pool, and takes all of it from
+ * the budget. Stacks of frames run on threads of their own.
+ */
+static GMutex budget_lock;
+static int threads_in_use = 0;
+static size_t cache_bytes_in_use = 0;
+static size_t cache_budget = THUMBNAIL_CACHE_BUDGET;
+
+/* About this many input pixels per thread before another thread is worth
+ * waking up.
+ */
+#define PIXELS_PER_THREAD (1024 * 1024)
+
+/* Aim for cache tiles of about this size, and no more than this many lines
+ * high.
+ */
+#define CACHE_TILE_BYTES (256 * 1024)
+#define CACHE_MAX_TILE_HEIGHT (16)
+
+void
+thumbnail_set_cache_budget( size_t bytes )
+{
+  g_mutex_lock( &budget_lock );
+  cache_budget = bytes;
+  g_mutex_unlock( &budget_lock );
+}
+
+static int
+thumbnail_reserve_threads( VipsImage *in, int n_frames, ThumbnailOptions options )
+{
+  int wanted;
+  int available;
+
+  if( options.threads > 0 ) {
+    wanted = options.threads;
+  }
+  else {
+    wanted = 1 + VIPS_IMAGE_N_PELS( in ) / PIXELS_PER_THREAD;
+  }
+
+  g_mutex_lock( &budget_lock );
+  available = VIPS_MAX( 1, vips_concurrency_get() - threads_in_use );
+  wanted = VIPS_CLIP( 1, wanted, available );
+  if( n_frames ) {
+    wanted = VIPS_MIN( wanted, n_frames );
+  }
+  else if( wanted > 1 ) {
+    /* The vips pool renders with all its threads, so only take it when
+     * nobody else has any of them.
+     */
+    wanted = threads_in_use == 0 ? vips_concurrency_get() : 1;
+  }
+  threads_in_use += wanted;
+  g_mutex_unlock( &budget_lock );
+
+  return( wanted );
+}
+
+/* Size the scanline cache in front of the affine. We need to keep about
+ * nlines * 2 lines of input to serve a line of output tiles without stalls,
+ * and no fewer than nlines plus a tile or threads will deadlock on the
+ * sequential read. Wide images get short tiles so we don't hold more than
+ * we need.
+ */
+static void
+thumbnail_reserve_cache( VipsImage *in, int nlines, ThumbnailOptions options, ThumbnailResult *result )
+{
+  size_t line = VIPS_MAX( 1, VIPS_IMAGE_SIZEOF_LINE( in ) );
+  int tile_height;
+  int lines;
+
+  if( options.cache_tile_height > 0 ) {
+    tile_height = options.cache_tile_height;
+  }
+  else {
+    tile_height = VIPS_CLIP( 1, (int) (CACHE_TILE_BYTES / line), CACHE_MAX_TILE_HEIGHT );
+  }
+
+  g_mutex_lock( &budget_lock );
+
+  if( options.cache_max_tiles > 0 ) {
+    lines = options.cache_max_tiles * tile_height;
+  }
+  else {
+    lines = nlines * 2;
+
+    if( cache_bytes_in_use + lines * line > cache_budget ) {
+      lines = nlines + tile_height;
+    }
+  }
+
+  result->cache_tile_height = tile_height;
+  result->cache_max_tiles = VIPS_MAX( 1, (lines + tile_height - 1) / tile_height );
+  result->cache_bytes = (size_t) result->cache_max_tiles * tile_height * line;
+  cache_bytes_in_use += result->cache_bytes;
+
+  g_mutex_unlock( &budget_lock );
+}
+
+static void
+thumbnail_release( ThumbnailResult *result )
+{
+  g_mutex_lock( &budget_lock );
+  threads_in_use -= result->threads;
+  cache_bytes_in_use -= result->cache_bytes;
+  g_mutex_unlock( &budget_lock );
+}
+
+/* Up to @wanted more threads from the budget, for as long as a job needs
+ * helpers beyond what it reserved. Maybe none.
+ */
+static int
+thumbnail_borrow_threads( int wanted )
+{
+  int granted;
+
+  g_mutex_lock( &budget_lock );
+  granted = VIPS_CLIP( 0, wanted, vips_concurrency_get() - threads_in_use );
+  threads_in_use += granted;
+  g_mutex_unlock( &budget_lock );
+
+  return( granted );
+}
+
+static void
+thumbnail_return_threads( int n )
+{
+  g_mutex_lock( &budget_lock );
+  threads_in_use -= n;
+  g_mutex_unlock( &budget_lock );
+}
+
+/* Jobs split work like encoding several outputs over helpers from this one
+ * pool, never threads of their own, so the budget above bounds them.
+ */
+typedef struct {
+  GThreadFunc fn;
+  gpointer data;
+  int pending;
+  GMutex lock;
+  GCond cond;
+} ThumbnailHelpers;
+
+static void
+thumbnail_helper( gpointer item, gpointer user_data )
+{
+  ThumbnailHelpers *helpers = (ThumbnailHelpers *) item;
+
+  helpers->fn( helpers->data );
+
+  g_mutex_lock( &helpers->lock );
+  helpers->pending -= 1;
+  g_cond_signal( &helpers->cond );
+  g_mutex_unlock( &helpers->lock );
+}
+
+static gpointer
+thumbnail_helper_pool_new( gpointer data )
+{
+  return( g_thread_pool_new( thumbnail_helper, NULL, 
+    vips_concurrency_get(), FALSE, NULL ) );
+}
+
+/* Run @fn( @data ) in this thread and in @n_helpers pool threads at once,
+ * and wait for them all. @fn should take work items until there are none
+ * left, so it doesn't matter how soon the helpers start.
+ */
+static void
+thumbnail_parallel( GThreadFunc fn, gpointer data, int n_helpers )
+{
+  static GOnce pool_once = G_ONCE_INIT;
+  GThreadPool *pool;
+  ThumbnailHelpers helpers;
+  int i;
+
+  if( n_helpers <= 0 ) {
+    fn( data );
+    return;
+  }
+
+  pool = (GThreadPool *) g_once( &pool_once, thumbnail_helper_pool_new, NULL );
+
+  helpers.fn = fn;
+  helpers.data = data;
+  helpers.pending = n_helpers;
+  g_mutex_init( &helpers.lock );
+  g_cond_init( &helpers.cond );
 
-  if( mask )
-    vips_object_local( process, mask );
+  for( i = 0; i < n_helpers; i++ ) {
+    g_thread_pool_push( pool, &helpers, NULL );
+  }
+
+  fn( data );
+
+  g_mutex_lock( &helpers.lock );
+  while( helpers.pending ) {
+    g_cond_wait( &helpers.cond, &helpers.lock );
+  }
+  g_mutex_unlock( &helpers.lock );
 
-  return( mask );
+  g_mutex_clear( &helpers.lock );
+  g_cond_clear( &helpers.cond );
 }
 
 static VipsImage *
-thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, VipsImage *sharpen, ThumbnailOptions options )
+thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, VipsImage *sharpen, ThumbnailOptions options, ThumbnailResult *result )
 {
   VipsImage **t = (VipsImage **) vips_object_local_array( process, 10 );
   VipsInterpretation interpretation = options.linear_processing ? VIPS_INTERPRETATION_XYZ : VIPS_INTERPRETATION_sRGB; 
@@ -242,7 +643,7 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
   /* RAD needs special unpacking.
    */
   if( in->Coding == VIPS_CODING_RAD ) {
-    vips_info( options.context_name, "unpacking Rad to float" );
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "unpacking Rad to float" );
 
     /* rad is scrgb.
      */
@@ -266,10 +667,10 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
     (vips_image_get_typeof( in, VIPS_META_ICC_NAME ) || 
      options.import_profile) ) {
     if( vips_image_get_typeof( in, VIPS_META_ICC_NAME ) ) {
-      vips_info( options.context_name, "importing with embedded profile" );
+      thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "importing with embedded profile" );
     }
     else {
-      vips_info( options.context_name, "importing with profile %s", options.import_profile ); 
+      thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "importing with profile %s", options.import_profile ); 
     }
 
     if( vips_icc_import( in, &t[1], 
@@ -284,7 +685,7 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
 
   /* To the processing colourspace. This will unpack LABQ as well.
    */
-  vips_info( options.context_name, "converting to processing space %s",
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "converting to processing space %s",
              vips_enum_nick( VIPS_TYPE_INTERPRETATION, interpretation ) ); 
 
   if( vips_colourspace( in, &t[2], interpretation, NULL ) ) {
@@ -296,7 +697,7 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
   double full_shrink;
   shrink = calculate_shrink( in, &residual, &full_shrink, options );
 
-  vips_info( options.context_name, "integer shrink by %d", shrink );
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "shrink", "integer shrink by %d", shrink );
 
   if(full_shrink <= 1.0) {
     if( vips_shrink( in, &t[3], shrink, shrink, NULL ) ) {
@@ -333,11 +734,15 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
    * this cache lock. 
    */
   vips_get_tile_size( in, &tile_width, &tile_height, &nlines );
+  thumbnail_reserve_cache( in, nlines, options, result );
+
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "cache", "caching %d tiles of %d lines, %zu bytes", 
+    result->cache_max_tiles, result->cache_tile_height, result->cache_bytes );
 
   if( vips_tilecache( in, &t[4], 
     "tile_width", in->Xsize,
-    "tile_height", 10,
-    "max_tiles", (nlines * 2) / 10,
+    "tile_height", result->cache_tile_height,
+    "max_tiles", result->cache_max_tiles,
     "access", VIPS_ACCESS_SEQUENTIAL,
     "threaded", TRUE, 
     NULL ) ||
@@ -348,8 +753,8 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
   }
   in = t[5];
 
-  vips_info( options.context_name, "residual scale by %g", residual );
-  vips_info( options.context_name, "%s interpolation", VIPS_OBJECT_GET_CLASS( interp )->nickname );
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "shrink", "residual scale by %g", residual );
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "shrink", "%s interpolation", VIPS_OBJECT_GET_CLASS( interp )->nickname );
 
   /* Colour management.
    *
@@ -359,14 +764,14 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
   if( options.linear_processing ) {
     if( options.export_profile ||
       vips_image_get_typeof( in, VIPS_META_ICC_NAME ) ) {
-      vips_info( options.context_name, "exporting to device space with a profile" );
+      thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "exporting to device space with a profile" );
       if( vips_icc_export( in, &t[7], "output_profile", options.export_profile, NULL ) ) {  
         return( NULL );
       }
       in = t[7];
     }
     else {
-      vips_info( options.context_name, "converting to sRGB" );
+      thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "converting to sRGB" );
       if( vips_colourspace( in, &t[6], VIPS_INTERPRETATION_sRGB, NULL ) ) {
         return( NULL ); 
       }
@@ -375,13 +780,13 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
   }
   else if( options.export_profile && (vips_image_get_typeof( in, VIPS_META_ICC_NAME ) ||  options.import_profile) ) {
     if( vips_image_get_typeof( in, VIPS_META_ICC_NAME ) ) {
-      vips_info( options.context_name, "importing with embedded profile" );
+      thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "importing with embedded profile" );
     }
     else {
-      vips_info( options.context_name, "importing with profile %s", options.import_profile );
+      thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "importing with profile %s", options.import_profile );
     }
 
-    vips_info( options.context_name, "exporting with profile %s", options.export_profile );
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "exporting with profile %s", options.export_profile );
 
     if( vips_icc_transform( in, &t[6], options.export_profile, "input_profile", options.import_profile, "embedded", TRUE, NULL ) ) {
       return( NULL );
@@ -396,7 +801,7 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
   if( shrink >= 1 && 
     residual <= 1.0 && 
     sharpen ) { 
-    vips_info( options.context_name, "sharpening thumbnail" );
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "sharpen", "sharpening thumbnail" );
     if( vips_conv( in, &t[8], sharpen, NULL ) ) {
       return( NULL );
     }
@@ -405,7 +810,7 @@ thumbnail_shrink( VipsObject *process, VipsImage *in, VipsInterpolate *interp, V
 
   if( options.delete_profile &&
     vips_image_get_typeof( in, VIPS_META_ICC_NAME ) ) {
-    vips_info( options.context_name, "deleting profile from output image" );
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "colour", "deleting profile from output image" );
     if( !vips_image_remove( in, VIPS_META_ICC_NAME ) ) 
       return( NULL );
   }
@@ -443,30 +848,52 @@ thumbnail_rotate( VipsObject *process, VipsImage *im, ThumbnailOptions options )
   if( options.rotate_image ) {
     VipsAngle angle = get_angle( im );
     if( vips_rot( im, &t[0], angle, NULL ) ) {
-      vips_info(options.context_name, "failed to rotation image %d", angle);
+      thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "rotate", "failed to rotate image by %d", angle );
 
       return( NULL );
     }
        
     im = t[0];
 
-    vips_info(options.context_name, "rotated image");
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "rotate", "rotated image" );
     (void) vips_image_remove( im, ORIENTATION );
   }
 
   return( im );
 }
 
-/* Given (eg.) "/poop/somefile.png", write @im to the thumbnail name,
- * (eg.) "/poop/tn_somefile.jpg".
+/* Output names are printf formats, and can come from a request, so allow
+ * at most one "%s" and no other conversion but "%%".
  */
 static int
-thumbnail_write( VipsImage *im, const char *filename, ThumbnailOptions options )
+thumbnail_check_format( const char *format )
+{
+  int n_names = 0;
+  const char *p;
+
+  for( p = format; (p = strchr( p, '%' )); p += 2 ) {
+    if( p[1] == 's' && n_names++ == 0 ) 
+      continue;
+    if( p[1] == '%' )
+      continue;
+
+    thumbnail_error( "thumbnail", "bad output name \"%s\", use one %%s for the file name and %%%% for %%", format );
+    return( -1 );
+  }
+
+  return( 0 );
+}
+
+char *
+thumbnail_output_name( const char *format, const char *filename )
 {
   char *file;
   char *p;
   char buf[FILENAME_MAX];
-  char *output_name;
+
+  if( thumbnail_check_format( format ) ) {
+    return( NULL );
+  }
 
   file = g_path_get_basename( filename );
 
@@ -478,66 +905,1274 @@ thumbnail_write( VipsImage *im, const char *filename, ThumbnailOptions options )
   /* output_format can be an absolute path, in which case we discard the
    * path from the incoming file.
    */
-  vips_snprintf( buf, FILENAME_MAX, options.output_format, file );
+  vips_snprintf( buf, FILENAME_MAX, format, file );
+
+  g_free( file );
+
   /* Stock vipsthumbnail does some stupid stuf with relative file names. 
    * Ignore that, just use the path we're given.
    */
-  output_name = g_strdup( buf );
+  return( g_strdup( buf ) );
+}
+
+/* Given (eg.) "/poop/somefile.png" and a @format of "/poop/tn_%s.jpg",
+ * write @im to the thumbnail name, (eg.) "/poop/tn_somefile.jpg".
+ *
+ * If @format is just a suffix, (eg.) ".jpg[Q=80]", encode to memory and
+ * hand the bytes back in @output instead.
+ */
+static int
+thumbnail_write( VipsImage *im, const char *filename, const char *format, ThumbnailOptions options, ThumbnailOutput *output )
+{
+  char *output_name;
+  char *p;
 
-  vips_info( options.context_name, "thumbnailing %s as %s", filename, output_name );
+  if( format[0] == '.' ) {
+    thumbnail_log( options, THUMBNAIL_LOG_INFO, "save", "thumbnailing %s to memory as %s", filename, format );
 
-  g_free( file );
+    if( thumbnail_pool_encode( im, format, &output->data, &output->length ) ) {
+      return( -1 );
+    }
+
+    return( 0 );
+  }
+
+  if( !(output_name = thumbnail_output_name( format, filename )) ) {
+    return( -1 );
+  }
+
+  thumbnail_log( options, THUMBNAIL_LOG_INFO, "save", "thumbnailing %s as %s", filename, output_name );
 
   if( vips_image_write_to_file( im, output_name ) ) {
     g_free( output_name );
     return( -1 );
   }
-  g_free( output_name );
+
+  /* Record the file we wrote, less any save options, as the budget and
+   * passthrough paths do.
+   */
+  if( (p = strrchr( output_name, '[' )) ) {
+    *p = '\0';
+  }
+  output->name = output_name;
 
   return( 0 );
 }
 
-int
-thumbnail_process( VipsObject *process, const char *filename, ThumbnailOptions options )
+/* Lossy formats where we can trade quality for bytes. For JPEG we can trade
+ * chroma subsampling too.
+ */
+static const struct {
+  const char *suffix;
+  gboolean jpeg;
+} budget_suffixes[] = {
+  { ".jpg", TRUE },
+  { ".jpeg", TRUE },
+  { ".jpe", TRUE },
+  { ".jfif", TRUE },
+  { ".webp", FALSE },
+  { ".avif", FALSE },
+  { ".heic", FALSE },
+  { ".heif", FALSE }
+};
+
+#define BUDGET_MIN_QUALITY (10)
+#define BUDGET_MAX_QUALITY (90)
+
+/* The save options of @format, eg. "Q=80" and "strip" from
+ * "tn_%s.jpg[Q=80,strip]", with spaces trimmed. Free with g_strfreev().
+ */
+static char **
+thumbnail_save_options( const char *format )
 {
-  VipsImage *sharpen = thumbnail_sharpen( process, options );
+  const char *open = strrchr( format, '[' );
+  char *options;
+  char **entries;
+  int i;
 
-  VipsImage *in;
-  VipsInterpolate *interp;
-  VipsImage *thumbnail;
-  VipsImage *crop;
-  VipsImage *rotate;
+  if( !open ) {
+    return( g_new0( char *, 1 ) );
+  }
 
-  if( !(in = thumbnail_open( process, filename, options )) ||
-    !(interp = thumbnail_interpolator( process, in, options )) ||
-    !(thumbnail = 
-      thumbnail_shrink( process, in, interp, sharpen, options )) ||
-    !(crop = thumbnail_crop( process, thumbnail, options )) ||
-    !(rotate = thumbnail_rotate( process, crop, options )) ||
-    thumbnail_write( rotate, filename, options ) )
-    return( -1 );
+  options = g_strndup( open + 1, strcspn( open + 1, "]" ) );
+  entries = g_strsplit( options, ",", -1 );
+  g_free( options );
 
-  return( 0 );
+  for( i = 0; entries[i]; i++ ) 
+    g_strstrip( entries[i] );
+
+  return( entries );
 }
 
-int
-simple_transform(const char* filename, ThumbnailOptions options) {
-  int error = 0;
+/* From the options of (eg.) "tn_%s.jpg[Q=80,strip]", set Q as the quality
+ * to search down from and return the rest, less the ones we search over,
+ * for each encode. Free with g_free().
+ */
+static char *
+budget_options( const char *format, int *quality )
+{
+  char **entries = thumbnail_save_options( format );
+  char *kept;
+  size_t length;
+  int i;
+
+  length = 1;
+  for( i = 0; entries[i]; i++ ) 
+    length += strlen( entries[i] ) + 1;
+
+  kept = g_malloc( length );
+  kept[0] = '\0';
+
+  for( i = 0; entries[i]; i++ ) {
+    char *entry = entries[i];
+
+    if( g_str_has_prefix( entry, "Q=" ) ) 
+      *quality = VIPS_CLIP( BUDGET_MIN_QUALITY, atoi( entry + 2 ), 100 );
+    else if( *entry &&
+      !g_str_has_prefix( entry, "no_subsample" ) &&
+      !g_str_has_prefix( entry, "subsample_mode" ) ) {
+      if( *kept ) 
+        strcat( kept, "," );
+      strcat( kept, entry );
+    }
+  }
 
-  if( vips_init( filename ) ) {
-    vips_error( options.context_name, "unable to start VIPS" );
-    error = 1;
+  g_strfreev( entries );
+
+  return( kept );
+}
+
+static int
+budget_encode( VipsImage *im, const char *suffix, const char *kept, int quality, gboolean no_subsample, void **buf, size_t *length )
+{
+  char format[FILENAME_MAX];
+
+  if( quality ) 
+    vips_snprintf( format, FILENAME_MAX, "%s[%s%sQ=%d%s]", suffix, 
+      kept, *kept ? "," : "", quality, no_subsample ? ",no_subsample" : "" );
+  else
+    vips_snprintf( format, FILENAME_MAX, "%s[%s]", suffix, kept );
+
+  return( thumbnail_pool_encode( im, format, buf, length ) );
+}
+
+/* Binary search [low, high] for the highest quality that fits in max_bytes.
+ * Returns that quality with its encoding in @best, 0 if nothing fits, or -1
+ * on error.
+ */
+static int
+budget_search( VipsImage *im, const char *suffix, const char *kept, gboolean no_subsample, int low, int high, void **best, size_t *best_length, ThumbnailOptions options )
+{
+  int found = 0;
+
+  while( low <= high ) {
+    int quality = (low + high) / 2;
+    void *buf;
+    size_t length;
+
+    if( budget_encode( im, suffix, kept, quality, no_subsample, &buf, &length ) ) {
+      return( -1 );
+    }
+
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "budget", "Q=%d%s is %zu bytes", 
+      quality, no_subsample ? " without subsampling" : "", length );
+
+    if( length <= options.max_bytes ) {
+      thumbnail_pool_free( *best );
+      *best = buf;
+      *best_length = length;
+      found = quality;
+      low = quality + 1;
+    }
+    else {
+      thumbnail_pool_free( buf );
+      high = quality - 1;
+    }
   }
-  else {
-    VipsObject *process = VIPS_OBJECT( vips_image_new() ); 
 
-    if( thumbnail_process( process, filename, options ) ) {
-      error = 2;
-      fprintf( stderr, "%s: unable to thumbnail %s\n", options.context_name, filename );
-      fprintf( stderr, "%s", vips_error_buffer() );
-      vips_error_clear();
+  return( found );
+}
+
+/* Write @im as the best quality that fits in max_bytes. @im should be in
+ * memory, since we encode it several times; only the winner is written.
+ * @kept and @high are from budget_options().
+ *
+ * For JPEG we also try with and without chroma subsampling. Subsampling
+ * buys a higher Q in the same bytes, so we take whichever reaches the
+ * higher quality, and full chroma on a tie.
+ */
+static int
+thumbnail_write_budget( VipsImage *im, const char *filename, const char *format, const char *kept, int high, ThumbnailOptions options, ThumbnailOutput *output )
+{
+  gboolean to_memory = format[0] == '.';
+  char *name = to_memory ? 
+    g_strdup( format ) : 
+    thumbnail_output_name( format, filename );
+  const char *suffix;
+  gboolean lossy = FALSE;
+  gboolean jpeg = FALSE;
+  void *buf = NULL;
+  size_t length = 0;
+  int quality = 0;
+  int status = 0;
+  int i;
+
+  if( !name ) {
+    return( -1 );
+  }
+
+  if( strrchr( name, '[' ) ) {
+    *strrchr( name, '[' ) = '\0';
+  }
+  suffix = strrchr( name, '.' );
+
+  if( !suffix ) {
+    thumbnail_error( options.context_name, "no file type in \"%s\"", name );
+    status = -1;
+  }
+  else {
+    for( i = 0; i < VIPS_NUMBER( budget_suffixes ); i++ ) {
+      if( g_ascii_strcasecmp( suffix, budget_suffixes[i].suffix ) == 0 ) {
+        lossy = TRUE;
+        jpeg = budget_suffixes[i].jpeg;
+      }
+    }
+  }
+
+  if( !status && lossy ) {
+    if( (quality = budget_search( im, suffix, kept, jpeg, 
+      BUDGET_MIN_QUALITY, high, &buf, &length, options )) < 0 ) {
+      status = -1;
+    }
+    else if( jpeg && quality < high ) {
+      void *subsampled = NULL;
+      size_t subsampled_length = 0;
+      int subsampled_quality;
+
+      if( (subsampled_quality = budget_search( im, suffix, kept, FALSE, 
+        VIPS_MAX( quality + 1, BUDGET_MIN_QUALITY ), high, 
+        &subsampled, &subsampled_length, options )) < 0 ) {
+        thumbnail_pool_free( subsampled );
+        status = -1;
+      }
+      else if( subsampled_quality > quality ) {
+        thumbnail_pool_free( buf );
+        buf = subsampled;
+        length = subsampled_length;
+        quality = subsampled_quality;
+      }
+    }
+
+    /* Nothing fits, so the smallest we can make will have to do.
+     */
+    if( !status && !quality ) {
+      quality = BUDGET_MIN_QUALITY;
+      if( budget_encode( im, suffix, kept, quality, FALSE, &buf, &length ) ) {
+        status = -1;
+      }
+    }
+
+    output->quality = quality;
+  }
+  else if( !status ) {
+    /* Nothing to search over, so just see if it fits.
+     */
+    if( budget_encode( im, suffix, kept, 0, FALSE, &buf, &length ) ) {
+      status = -1;
+    }
+  }
+
+  if( !status && length > options.max_bytes ) {
+    thumbnail_log( options, THUMBNAIL_LOG_WARN, "budget", "%s is %zu bytes, over the budget of %zu", 
+      filename, length, options.max_bytes );
+    output->over_budget = TRUE;
+  }
+
+  if( !status ) {
+    thumbnail_log( options, THUMBNAIL_LOG_INFO, "save", "thumbnailing %s as %s, Q=%d, %zu bytes", 
+      filename, to_memory ? "memory" : name, quality, length );
+
+    if( to_memory ) {
+      output->data = buf;
+      output->length = length;
+      buf = NULL;
+    }
+    else {
+      GError *error = NULL;
+
+      if( !g_file_set_contents( name, buf, length, &error ) ) {
+        thumbnail_error( options.context_name, "%s", error->message );
+        g_error_free( error );
+        status = -1;
+      }
+      else {
+        output->name = name;
+        name = NULL;
+      }
+    }
+  }
+
+  thumbnail_pool_free( buf );
+  g_free( name );
+
+  return( status );
+}
+
+/* One encoding, run on a thread of its own when a job has several.
+ */
+typedef struct {
+  VipsImage *im;
+  const char *filename;
+  const char *format;
+  ThumbnailOptions *options;
+  ThumbnailOutput *output;
+  char *kept;
+  int high;
+  int status;
+  char *error;
+} ThumbnailEncode;
+
+static void
+thumbnail_encode( ThumbnailEncode *encode )
+{
+  encode->status = encode->options->max_bytes ?
+    thumbnail_write_budget( encode->im, encode->filename, encode->format, 
+      encode->kept, encode->high, *encode->options, encode->output ) :
+    thumbnail_write( encode->im, encode->filename, encode->format, *encode->options, encode->output );
+}
+
+typedef struct {
+  ThumbnailEncode *encodes;
+  int n;
+  int next;
+} ThumbnailEncodes;
+
+/* Take encodes until there are none left. Errors are kept per thread, so
+ * bring them back for the job to report.
+ */
+static gpointer
+thumbnail_encodes_thread( gpointer data )
+{
+  ThumbnailEncodes *encodes = (ThumbnailEncodes *) data;
+  int i;
+
+  while( (i = g_atomic_int_add( &encodes->next, 1 )) < encodes->n ) {
+    ThumbnailEncode *encode = &encodes->encodes[i];
+
+    thumbnail_encode( encode );
+    if( encode->status ) 
+      encode->error = thumbnail_error_take();
+  }
+
+  return( NULL );
+}
+
+/* The formats to write, from output_formats or output_format.
+ */
+static int
+thumbnail_formats( ThumbnailOptions options, const char **formats )
+{
+  int n = 0;
+
+  if( !options.output_formats ) {
+    formats[n++] = options.output_format;
+  }
+  else {
+    for( ; options.output_formats[n]; n++ ) {
+      if( n == THUMBNAIL_MAX_OUTPUTS ) {
+        thumbnail_error( options.context_name, "more than %d output formats", THUMBNAIL_MAX_OUTPUTS );
+        return( -1 );
+      }
+      formats[n] = options.output_formats[n];
+    }
+  }
+
+  if( !n || !formats[0] ) {
+    thumbnail_error( options.context_name, "no output format" );
+    return( -1 );
+  }
+
+  return( n );
+}
+
+/* Write @im once for each format. With more than one, @im has been 
+ * rendered to memory, so encoders don't share any pipeline, and they run
+ * side by side on this thread and as many helpers as the thread budget
+ * allows.
+ */
+static int
+thumbnail_write_outputs( VipsImage *im, const char *filename, const char **formats, int n, ThumbnailOptions options, ThumbnailResult *result )
+{
+  ThumbnailEncode encodes[THUMBNAIL_MAX_OUTPUTS];
+  ThumbnailEncodes work;
+  int borrowed;
+  int status = 0;
+  int i;
+
+  for( i = 0; i < n; i++ ) {
+    encodes[i].im = im;
+    encodes[i].filename = filename;
+    encodes[i].format = formats[i];
+    encodes[i].options = &options;
+    encodes[i].output = &result->outputs[i];
+    encodes[i].kept = NULL;
+    encodes[i].high = BUDGET_MAX_QUALITY;
+    encodes[i].status = 0;
+    encodes[i].error = NULL;
+
+    if( options.max_bytes ) {
+      encodes[i].kept = budget_options( formats[i], &encodes[i].high );
+    }
+  }
+
+  /* Set before we start, so a failure still frees whatever was made.
+   */
+  result->n_outputs = n;
+
+  work.encodes = encodes;
+  work.n = n;
+  work.next = 0;
+
+  /* Our own threads first, then whatever else is free.
+   */
+  borrowed = thumbnail_borrow_threads( n - VIPS_MAX( 1, result->threads ) );
+  thumbnail_parallel( thumbnail_encodes_thread, &work, 
+    VIPS_MIN( n - 1, VIPS_MAX( 1, result->threads ) - 1 + borrowed ) );
+  thumbnail_return_threads( borrowed );
+
+  for( i = 0; i < n; i++ ) {
+    if( encodes[i].status ) {
+      status = -1;
+    }
+    if( encodes[i].error ) {
+      thumbnail_error( NULL, "%s", encodes[i].error );
+      g_free( encodes[i].error );
+    }
+    g_free( encodes[i].kept );
+  }
+
+  return( status );
+}
+
+/* Write @im, the full-size source, as a DeepZoom, Zoomify or Google Maps
+ * tile pyramid named from pyramid_output, the same way as output_format.
+ *
+ * dzsave builds every level from a single pass over the image and saves 
+ * tiles from the vips worker threads. Colour goes through the import and
+ * export profiles like the thumbnail's. dzsave averages each level down
+ * in the space we give it, so linear_processing has no effect here.
+ */
+static int
+thumbnail_write_pyramid( VipsObject *process, VipsImage *im, const char *filename, ThumbnailOptions options, ThumbnailResult *result )
+{
+  VipsImage **t = (VipsImage **) vips_object_local_array( process, 4 );
+  char *pyramid_name;
+  int layout;
+
+  if( (layout = vips_enum_from_nick( options.context_name, 
+    VIPS_TYPE_FOREIGN_DZ_LAYOUT, options.pyramid_layout )) < 0 ) {
+    return( -1 );
+  }
+
+  if( im->Coding == VIPS_CODING_RAD ) {
+    if( vips_rad2float( im, &t[0], NULL ) ) {
+      return( -1 );
+    }
+    im = t[0];
+  }
+
+  if( options.export_profile && 
+    (vips_image_get_typeof( im, VIPS_META_ICC_NAME ) || options.import_profile) ) {
+    thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "pyramid", "exporting with profile %s", options.export_profile );
+
+    if( vips_icc_transform( im, &t[1], options.export_profile, 
+      "input_profile", options.import_profile,
+      "embedded", TRUE,
+      NULL ) ) {
+      return( -1 );
+    }
+    im = t[1];
+  }
+
+  if( vips_colourspace( im, &t[2], VIPS_INTERPRETATION_sRGB, NULL ) ) {
+    return( -1 );
+  }
+  im = t[2];
+
+  if( options.rotate_image ) {
+    if( vips_rot( im, &t[3], get_angle( im ), NULL ) ) {
+      return( -1 );
+    }
+    im = t[3];
+  }
+
+  if( !(pyramid_name = thumbnail_output_name( options.pyramid_output, filename )) ) {
+    return( -1 );
+  }
+
+  thumbnail_log( options, THUMBNAIL_LOG_INFO, "pyramid", "writing %s pyramid of %s as %s, %d pixel tiles", 
+    options.pyramid_layout, filename, pyramid_name, options.pyramid_tile_size );
+
+  if( vips_dzsave( im, pyramid_name, 
+    "layout", layout,
+    "tile_size", options.pyramid_tile_size,
+    "overlap", options.pyramid_overlap,
+    "suffix", options.pyramid_suffix,
+    NULL ) ) {
+    g_free( pyramid_name );
+    return( -1 );
+  }
+  result->pyramid_name = pyramid_name;
+
+  return( 0 );
+}
+
+/* Render the finished pipeline into memory in the calling thread, a strip
+ * at a time and top to bottom, so our sequential source is happy.
+ */
+static int
+thumbnail_evaluate_serial( VipsImage *im, VipsImage *memory )
+{
+  VipsRegion *region;
+  int tile_width;
+  int tile_height;
+  int nlines;
+  int y;
+  int i;
+
+  if( vips_image_pipelinev( memory, VIPS_DEMAND_STYLE_THINSTRIP, im, NULL ) ||
+    vips_image_write_prepare( memory ) ) {
+    return( -1 );
+  }
+
+  vips_get_tile_size( im, &tile_width, &tile_height, &nlines );
+  region = vips_region_new( im );
+
+  for( y = 0; y < im->Ysize; y += nlines ) {
+    VipsRect strip;
+
+    strip.left = 0;
+    strip.top = y;
+    strip.width = im->Xsize;
+    strip.height = VIPS_MIN( nlines, im->Ysize - y );
+
+    if( vips_region_prepare( region, &strip ) ) {
+      g_object_unref( region );
+      return( -1 );
+    }
+
+    for( i = 0; i < strip.height; i++ ) {
+      if( vips_image_write_line( memory, y + i, VIPS_REGION_ADDR( region, 0, y + i ) ) ) {
+        g_object_unref( region );
+        return( -1 );
+      }
+    }
+  }
+
+  g_object_unref( region );
+
+  return( 0 );
+}
+
+/* Render the finished pipeline into memory, for when we need to read it
+ * more than once. Thumbnails are small, so this is cheap, and the memory
+ * comes from the pool.
+ */
+static VipsImage *
+thumbnail_evaluate( VipsObject *process, VipsImage *im, ThumbnailOptions options, ThumbnailResult *result )
+{
+  VipsImage *memory;
+
+  if( !(memory = thumbnail_pool_image( im )) ) {
+    return( NULL );
+  }
+
+  vips_object_local( process, memory );
+
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "render", "rendering %dx%d thumbnail to memory with %d threads", 
+    im->Xsize, im->Ysize, result->threads );
+
+  if( result->threads == 1 ?
+    thumbnail_evaluate_serial( im, memory ) :
+    vips_image_write( im, memory ) ) {
+    return( NULL );
+  }
+
+  return( memory );
+}
+
+/* One frame of a stack, with the cache it reserved and why it failed.
+ */
+typedef struct {
+  VipsImage *memory;
+  ThumbnailResult stats;
+  int status;
+  char *error;
+} ThumbnailFrame;
+
+/* Frames of @in for the workers to share. They take the next frame from
+ * next until there are none left.
+ */
+typedef struct {
+  VipsImage *in;
+  int page_height;
+  VipsInterpolate *interp;
+  VipsImage *sharpen;
+  ThumbnailOptions *options;
+  ThumbnailFrame *frames;
+  int n_frames;
+  int next;
+  int failed;
+} ThumbnailFrames;
+
+/* Cut out a frame and run it through the usual pipeline, into pool
+ * memory. Each frame has a pipeline of its own, so they need no locks.
+ */
+static int
+thumbnail_frame( ThumbnailFrames *frames, int i )
+{
+  ThumbnailFrame *frame = &frames->frames[i];
+  VipsObject *process = VIPS_OBJECT( vips_image_new() );
+  VipsImage **t = (VipsImage **) vips_object_local_array( process, 1 );
+  VipsImage *thumbnail;
+  VipsImage *crop;
+  VipsImage *rotate;
+  int status = 0;
+
+  if( vips_extract_area( frames->in, &t[0], 
+      0, i * frames->page_height, frames->in->Xsize, frames->page_height, NULL ) ||
+    !(thumbnail = thumbnail_shrink( process, t[0], frames->interp, frames->sharpen, *frames->options, &frame->stats )) ||
+    !(crop = thumbnail_crop( process, thumbnail, *frames->options )) ||
+    !(rotate = thumbnail_rotate( process, crop, *frames->options )) ||
+    !(frame->memory = thumbnail_pool_image( rotate )) ||
+    thumbnail_evaluate_serial( rotate, frame->memory ) ) {
+    status = -1;
+  }
+
+  g_object_unref( process );
+
+  return( status );
+}
+
+static gpointer
+thumbnail_frames_thread( gpointer data )
+{
+  ThumbnailFrames *frames = (ThumbnailFrames *) data;
+  int i;
+
+  while( !g_atomic_int_get( &frames->failed ) &&
+    (i = g_atomic_int_add( &frames->next, 1 )) < frames->n_frames ) {
+    if( (frames->frames[i].status = thumbnail_frame( frames, i )) ) {
+      frames->frames[i].error = thumbnail_error_take();
+      g_atomic_int_set( &frames->failed, 1 );
+    }
+  }
+
+  return( NULL );
+}
+
+/* Thumbnail each frame of a stack of pages or frames and stack the
+ * results back up, keeping PAGE_HEIGHT and so the animation, which savers
+ * like gif and webp write out. Frames all have the same size, so they share
+ * one plan: the interpolator and sharpen mask made for the first. They run
+ * side by side, as many at once as we have threads, this thread plus 
+ * helpers from the shared pool.
+ *
+ * @first is set to the first frame on its own, for analytics.
+ */
+static VipsImage *
+thumbnail_frames( VipsObject *process, VipsImage *in, int page_height, VipsImage *sharpen, ThumbnailOptions options, ThumbnailResult *result, VipsImage **first )
+{
+  VipsImage **t = (VipsImage **) vips_object_local_array( process, 3 );
+  ThumbnailFrames frames;
+  VipsImage **memory;
+  int i;
+
+  frames.in = in;
+  frames.page_height = page_height;
+  frames.sharpen = sharpen;
+  frames.options = &options;
+  frames.n_frames = in->Ysize / page_height;
+  frames.next = 0;
+  frames.failed = 0;
+
+  if( vips_extract_area( in, &t[0], 0, 0, in->Xsize, page_height, NULL ) ||
+    !(frames.interp = thumbnail_interpolator( process, t[0], options )) ) {
+    return( NULL );
+  }
+
+  frames.frames = g_new0( ThumbnailFrame, frames.n_frames );
+  memory = VIPS_ARRAY( process, frames.n_frames, VipsImage * );
+
+  thumbnail_log( options, THUMBNAIL_LOG_DEBUG, "frames", "thumbnailing %d frames of %dx%d with %d threads", 
+    frames.n_frames, in->Xsize, page_height, result->threads );
+
+  thumbnail_parallel( thumbnail_frames_thread, &frames, result->threads - 1 );
+
+  /* Every frame's cache is still reserved, so hand the lot to the job to
+   * release.
+   */
+  result->cache_tile_height = frames.frames[0].stats.cache_tile_height;
+  result->cache_max_tiles = frames.frames[0].stats.cache_max_tiles;
+  for( i = 0; i < frames.n_frames; i++ ) {
+    result->cache_bytes += frames.frames[i].stats.cache_bytes;
+
+    if( (memory[i] = frames.frames[i].memory) ) {
+      vips_object_local( process, memory[i] );
+    }
+
+    if( frames.frames[i].error ) {
+      thumbnail_error( NULL, "%s", frames.frames[i].error );
+      g_free( frames.frames[i].error );
+    }
+  }
+
+  g_free( frames.frames );
+
+  if( frames.failed ) {
+    return( NULL );
+  }
+
+  if( vips_arrayjoin( memory, &t[1], frames.n_frames, "across", 1, NULL ) ||
+    vips_copy( t[1], &t[2], NULL ) ) {
+    return( NULL );
+  }
+  vips_image_set_int( t[2], PAGE_HEIGHT, memory[0]->Ysize );
+
+  result->n_frames = frames.n_frames;
+  *first = memory[0];
+
+  return( t[2] );
+}
+
+static const char *error_names[] = {
+  "ok", "init", "process", "options", "load", "save", "request"
+};
+
+const char *
+thumbnail_error_name( ThumbnailError error )
+{
+  if( error < 0 || error >= VIPS_NUMBER( error_names ) ) {
+    return( "unknown" );
+  }
+
+  return( error_names[error] );
+}
+
+/* Record why the job failed. This takes the vips error buffer, so call it
+ * as soon as a step fails.
+ */
+static int
+thumbnail_fail( ThumbnailOptions options, ThumbnailResult *result, ThumbnailError error, const char *event, const char *filename )
+{
+  char *message = thumbnail_error_take();
+
+  if( !*message ) {
+    g_free( message );
+    message = g_strdup_printf( "%s failed", event );
+  }
+
+  result->error = error;
+  VIPS_FREE( result->error_message );
+  result->error_message = message;
+
+  thumbnail_log( options, THUMBNAIL_LOG_ERROR, event, "unable to thumbnail %s: %s", filename, message );
+
+  return( -1 );
+}
+
+/* "VipsForeignLoadJpegFile" or "VipsForeignSaveJpegBuffer" to "Jpeg", so
+ * we can see if a loader and saver are for the same format.
+ */
+static char *
+passthrough_family( const char *name )
+{
+  static const char *suffixes[] = { "File", "Buffer", "Source", "Target" };
+  char *family;
+  int i;
+
+  if( g_str_has_prefix( name, "VipsForeignLoad" ) ||
+    g_str_has_prefix( name, "VipsForeignSave" ) ) {
+    name += strlen( "VipsForeignLoad" );
+  }
+
+  family = g_strdup( name );
+
+  for( i = 0; i < VIPS_NUMBER( suffixes ); i++ ) {
+    if( g_str_has_suffix( family, suffixes[i] ) ) {
+      family[strlen( family ) - strlen( suffixes[i] )] = '\0';
+      break;
+    }
+  }
+
+  return( family );
+}
+
+/* The only save option we can honour without re-encoding is strip. Set
+ * @strip if it's there, FALSE if there's anything else.
+ */
+static gboolean
+passthrough_save_options( const char *format, gboolean *strip )
+{
+  char **entries = thumbnail_save_options( format );
+  gboolean plain = TRUE;
+  int i;
+
+  *strip = FALSE;
+
+  for( i = 0; entries[i]; i++ ) {
+    char *entry = entries[i];
+
+    if( strcmp( entry, "strip" ) == 0 ||
+      strcmp( entry, "strip=true" ) == 0 ||
+      strcmp( entry, "strip=1" ) == 0 ) 
+      *strip = TRUE;
+    else if( *entry )
+      plain = FALSE;
+  }
+
+  g_strfreev( entries );
+
+  return( plain );
+}
+
+/* JPEG segments to drop: ICC profiles with @drop_icc, and with @strip every
+ * APPn but JFIF (APP0) and Adobe (APP14, which says how to read the
+ * colour), plus comments.
+ */
+static gboolean
+passthrough_jpeg_drop( int marker, const unsigned char *data, size_t length, gboolean strip, gboolean drop_icc )
+{
+  if( marker == 0xE2 && 
+    length >= 12 && 
+    memcmp( data, "ICC_PROFILE", 12 ) == 0 ) {
+    return( strip || drop_icc );
+  }
+
+  return( strip &&
+    ((marker >= 0xE1 && marker <= 0xED) || marker == 0xEF || marker == 0xFE) );
+}
+
+/* Copy a JPEG with some of its header segments removed. Everything from
+ * the start of scan on is copied as is, so no pixel changes. NULL if it
+ * isn't laid out the way we expect.
+ */
+static void *
+passthrough_jpeg( const unsigned char *p, size_t length, gboolean strip, gboolean drop_icc, size_t *out_length )
+{
+  unsigned char *out;
+  size_t i;
+  size_t o;
+
+  if( length < 4 || p[0] != 0xFF || p[1] != 0xD8 ) {
+    return( NULL );
+  }
+
+  out = thumbnail_pool_alloc( length );
+  out[0] = 0xFF;
+  out[1] = 0xD8;
+  i = o = 2;
+
+  for(;;) {
+    size_t size;
+    int marker;
+
+    if( i >= length || p[i] != 0xFF ) {
+      thumbnail_pool_free( out );
+      return( NULL );
+    }
+
+    /* Markers can be padded with any number of 0xFF.
+     */
+    while( i < length && p[i] == 0xFF ) 
+      i++;
+
+    if( i + 3 > length ) {
+      thumbnail_pool_free( out );
+      return( NULL );
+    }
+
+    marker = p[i++];
+    size = (p[i] << 8) | p[i + 1];
+
+    if( size < 2 || i + size > length ) {
+      thumbnail_pool_free( out );
+      return( NULL );
+    }
+
+    if( marker == 0xDA ) {
+      out[o++] = 0xFF;
+      out[o++] = marker;
+      memcpy( out + o, p + i, length - i );
+      o += length - i;
+      break;
+    }
+
+    if( !passthrough_jpeg_drop( marker, p + i + 2, size - 2, strip, drop_icc ) ) {
+      out[o++] = 0xFF;
+      out[o++] = marker;
+      memcpy( out + o, p + i, size );
+      o += size;
+    }
+
+    i += size;
+  }
+
+  *out_length = o;
+
+  return( out );
+}
+
+/* If the source already is the thumbnail we'd make, copy its bytes to the
+ * output rather than decode, resample and re-encode it, which would only
+ * lose quality. That needs:
+ *
+ * - no resize, crop or rotate, and a single page
+ * - 8-bit sRGB or mono, so there's no colour conversion, and no profile
+ *   to export to
+ * - one output, in the same format as the source, with no save options
+ *   but strip
+ * - nothing that reads the pixels: analytics, a byte budget or a pyramid
+ *
+ * Stripping and delete_profile are done by dropping JPEG segments; other
+ * formats that need them go the long way.
+ *
+ * Returns 1 if the output was written, 0 if it needs the pipeline, -1 on
+ * error.
+ */
+static int
+thumbnail_passthrough( VipsImage *in, int shrink, ThumbnailSource source, const char *format, ThumbnailOptions options, ThumbnailResult *result )
+{
+  gboolean to_memory = format[0] == '.';
+  ThumbnailOutput *output = &result->outputs[0];
+  const char *loader;
+  const char *saver;
+  char *name;
+  char *loader_family;
+  char *saver_family;
+  gboolean same;
+  gboolean strip;
+  gboolean drop_icc;
+  double full_shrink;
+  int n_pages;
+  char *contents;
+  gsize length;
+  void *data;
+  size_t data_length;
+
+  /* A source shrunk on load isn't full size, whatever its size now.
+   */
+  if( !options.passthrough ||
+    shrink != 1 ||
+    options.analytics ||
+    options.max_bytes ||
+    options.pyramid_output ||
+    options.linear_processing ||
+    options.export_profile ||
+    in->Coding != VIPS_CODING_NONE ||
+    in->BandFmt != VIPS_FORMAT_UCHAR ||
+    (in->Type != VIPS_INTERPRETATION_sRGB && in->Type != VIPS_INTERPRETATION_B_W) ||
+    (vips_image_get_typeof( in, "n-pages" ) &&
+     !vips_image_get_int( in, "n-pages", &n_pages ) &&
+     n_pages > 1) ||
+    (options.rotate_image && get_angle( in ) != VIPS_ANGLE_0) ||
+    !passthrough_save_options( format, &strip ) ) {
+    return( 0 );
+  }
+
+  calculate_shrink( in, NULL, &full_shrink, options );
+  if( full_shrink != 1.0 ||
+    (options.crop_image &&
+     (in->Xsize != options.thumbnail_width || in->Ysize != options.thumbnail_height)) ) {
+    return( 0 );
+  }
+
+  if( !(name = to_memory ? 
+    g_strdup( format ) : 
+    thumbnail_output_name( format, source.filename )) ) {
+    return( -1 );
+  }
+
+  /* thumbnail_open() has already found a loader for these bytes, so this
+   * can't fail. The saver lookup can, on names vips has no saver for, so
+   * use ours, which leaves nothing in the error buffer.
+   */
+  loader = source.data ?
+    vips_foreign_find_load_buffer( source.data, source.length ) :
+    vips_foreign_find_load( source.filename );
+  saver = thumbnail_saver_find( name, to_memory ? "_buffer" : NULL );
+
+  if( !loader || !saver ) {
+    g_free( name );
+    return( 0 );
+  }
+
+  loader_family = passthrough_family( loader );
+  saver_family = passthrough_family( saver );
+  same = strcmp( loader_family, saver_family ) == 0;
+  drop_icc = options.delete_profile && vips_image_get_typeof( in, VIPS_META_ICC_NAME );
+
+  if( !same ||
+    ((strip || drop_icc) && strcmp( loader_family, "Jpeg" ) != 0) ) {
+    g_free( loader_family );
+    g_free( saver_family );
+    g_free( name );
+    return( 0 );
+  }
+
+  g_free( loader_family );
+  g_free( saver_family );
+
+  /* Files are read whole, so the bytes we check are the ones we copy.
+   */
+  contents = NULL;
+  if( source.data ) {
+    length = source.length;
+  }
+  else if( !g_file_get_contents( source.filename, &contents, &length, NULL ) ) {
+    g_free( name );
+    return( 0 );
+  }
+
+  if( strip || drop_icc ) {
+    if( !(data = passthrough_jpeg( source.data ? source.data : (void *) contents, length, strip, drop_icc, &data_length )) ) {
+      g_free( contents );
+      g_free( name );
+      return( 0 );
+    }
+  }
+  else {
+    data_length = length;
+    data = thumbnail_pool_alloc( data_length );
+    memcpy( data, source.data ? source.data : (void *) contents, data_length );
+  }
+  g_free( contents );
+
+  result->n_outputs = 1;
+
+  if( to_memory ) {
+    thumbnail_log( options, THUMBNAIL_LOG_INFO, "save", "passing %s through to memory, %zu bytes%s", 
+      source.filename, data_length, strip || drop_icc ? ", stripped" : "" );
+
+    output->data = data;
+    output->length = data_length;
+    g_free( name );
+  }
+  else {
+    GError *error = NULL;
+
+    /* The name less any save options.
+     */
+    if( strrchr( name, '[' ) ) {
+      *strrchr( name, '[' ) = '\0';
+    }
+
+    thumbnail_log( options, THUMBNAIL_LOG_INFO, "save", "passing %s through as %s, %zu bytes%s", 
+      source.filename, name, data_length, strip || drop_icc ? ", stripped" : "" );
+
+    if( !g_file_set_contents( name, data, data_length, &error ) ) {
+      thumbnail_error( options.context_name, "%s", error->message );
+      g_error_free( error );
+      thumbnail_pool_free( data );
+      g_free( name );
+      return( -1 );
+    }
+
+    thumbnail_pool_free( data );
+    output->name = name;
+  }
+
+  return( 1 );
+}
+
+static int
+thumbnail_run( VipsObject *process, ThumbnailSource source, ThumbnailOptions options, ThumbnailResult *result )
+{
+  VipsImage *sharpen;
+  VipsImage *in;
+  VipsImage *full;
+  VipsInterpolate *interp;
+  VipsImage *thumbnail;
+  VipsImage *crop;
+  VipsImage *rotate;
+  VipsImage *output;
+  VipsImage *first;
+  const char *formats[THUMBNAIL_MAX_OUTPUTS];
+  int n_formats;
+  int page_height;
+  int shrink;
+  int passed;
+  int i;
+
+  if( (n_formats = thumbnail_formats( options, formats )) < 0 )
+    return( thumbnail_fail( options, result, THUMBNAIL_ERROR_OPTIONS, "output", source.filename ) );
+
+  /* Names can come from a client, so check them before we do any work.
+   */
+  for( i = 0; i < n_formats; i++ )
+    if( thumbnail_check_format( formats[i] ) )
+      return( thumbnail_fail( options, result, THUMBNAIL_ERROR_REQUEST, "output", source.filename ) );
+
+  if( options.pyramid_output &&
+    thumbnail_check_format( options.pyramid_output ) )
+    return( thumbnail_fail( options, result, THUMBNAIL_ERROR_REQUEST, "pyramid", source.filename ) );
+
+  if( thumbnail_sharpen( process, options, &sharpen ) )
+    return( thumbnail_fail( options, result, THUMBNAIL_ERROR_OPTIONS, "sharpen", source.filename ) );
+
+  if( !(in = thumbnail_open( process, source, options, &shrink, &full )) )
+    return( thumbnail_fail( options, result, THUMBNAIL_ERROR_LOAD, "load", source.filename ) );
+
+  result->n_frames = 1;
+
+  /* So far we've only read the header. If that's enough to tell nothing
+   * would change, we can stop here.
+   */
+  if( n_formats == 1 &&
+    (passed = thumbnail_passthrough( in, shrink, source, formats[0], options, result )) ) {
+    if( passed < 0 )
+      return( thumbnail_fail( options, result, THUMBNAIL_ERROR_SAVE, "passthrough", source.filename ) );
+
+    return( 0 );
+  }
+
+  page_height = options.n_pages != 1 ? thumbnail_page_height( in ) : 0;
+
+  /* Size our share of the thread budget on the image we'll actually 
+   * decode, ie. after any shrink-on-load.
+   */
+  result->threads = thumbnail_reserve_threads( in, 
+    page_height ? in->Ysize / page_height : 0, options );
+
+  /* A stack of pages or frames is done a frame at a time, and comes back
+   * rendered.
+   */
+  if( page_height ) {
+    if( !(output = thumbnail_frames( process, in, page_height, sharpen, options, result, &first )) )
+      return( thumbnail_fail( options, result, THUMBNAIL_ERROR_PROCESS, "frames", source.filename ) );
+  }
+  else {
+    if( !(interp = thumbnail_interpolator( process, in, options )) )
+      return( thumbnail_fail( options, result, THUMBNAIL_ERROR_OPTIONS, "interpolate", source.filename ) );
+
+    if( !(thumbnail = 
+        thumbnail_shrink( process, in, interp, sharpen, options, result )) ||
+      !(crop = thumbnail_crop( process, thumbnail, options )) ||
+      !(rotate = thumbnail_rotate( process, crop, options )) )
+      return( thumbnail_fail( options, result, THUMBNAIL_ERROR_PROCESS, "shrink", source.filename ) );
+
+    output = rotate;
+
+    /* Analytics, the byte budget search and multiple outputs read the
+     * thumbnail more than once, and our source is sequential, so render
+     * it just the once. Single-threaded jobs render here too, in this 
+     * thread, rather than waking the vips worker pool.
+     */
+    if( (options.analytics || options.max_bytes || n_formats > 1 || result->threads == 1) &&
+      !(output = thumbnail_evaluate( process, rotate, options, result )) )
+      return( thumbnail_fail( options, result, THUMBNAIL_ERROR_PROCESS, "render", source.filename ) );
+
+    first = output;
+  }
+
+  if( options.analytics &&
+    thumbnail_analyse( process, first, options, result ) )
+    return( thumbnail_fail( options, result, THUMBNAIL_ERROR_PROCESS, "analytics", source.filename ) );
+
+  if( thumbnail_write_outputs( output, source.filename, formats, n_formats, options, result ) )
+    return( thumbnail_fail( options, result, THUMBNAIL_ERROR_SAVE, "save", source.filename ) );
+
+  if( options.pyramid_output &&
+    thumbnail_write_pyramid( process, full, source.filename, options, result ) )
+    return( thumbnail_fail( options, result, THUMBNAIL_ERROR_SAVE, "pyramid", source.filename ) );
+
+  return( 0 );
+}
+
+int
+thumbnail_process_source( VipsObject *process, ThumbnailSource source, ThumbnailOptions options, ThumbnailResult *result )
+{
+  int status;
+
+  if( !source.filename ) {
+    source.filename = "inline";
+  }
+
+  result->threads = 0;
+  result->cache_bytes = 0;
+  result->error = THUMBNAIL_OK;
+
+  status = thumbnail_run( process, source, options, result );
+
+  /* Our cache and threads are only used while the pipeline runs, so hand 
+   * them back. The counts stay in result for the caller.
+   */
+  thumbnail_release( result );
+  thumbnail_pool_stats( &result->pool );
+
+  return( status );
+}
+
+int
+thumbnail_process( VipsObject *process, const char *filename, ThumbnailOptions options )
+{
+  ThumbnailSource source = { filename, NULL, 0 };
+  ThumbnailResult result = { 0 };
+  int status;
+
+  status = thumbnail_process_source( process, source, options, &result );
+  thumbnail_result_clear( &result );
+
+  return( status );
+}
+
+void
+thumbnail_result_clear( ThumbnailResult *result )
+{
+  int i;
+
+  for( i = 0; i < result->n_outputs; i++ ) {
+    ThumbnailOutput *output = &result->outputs[i];
+
+    VIPS_FREE( output->name );
+    thumbnail_pool_free( output->data );
+    output->data = NULL;
+    output->length = 0;
+    output->quality = 0;
+    output->over_budget = FALSE;
+  }
+  result->n_outputs = 0;
+  result->n_frames = 0;
+  VIPS_FREE( result->pyramid_name );
+  result->analytics = 0;
+  result->threads = 0;
+  result->cache_tile_height = 0;
+  result->cache_max_tiles = 0;
+  result->cache_bytes = 0;
+  result->error = THUMBNAIL_OK;
+  VIPS_FREE( result->error_message );
+}
+
+int
+simple_transform(const char* filename, ThumbnailOptions options) {
+  int error = 0;
+
+  if( vips_init( filename ) ) {
+    thumbnail_log( options, THUMBNAIL_LOG_ERROR, "init", "unable to start VIPS" );
+    error = THUMBNAIL_ERROR_INIT;
+  }
+  else {
+    VipsObject *process = VIPS_OBJECT( vips_image_new() ); 
+    ThumbnailSource source = { filename, NULL, 0 };
+    ThumbnailResult result = { 0 };
+
+    /* The job has already logged why.
+     */
+    if( thumbnail_process_source( process, source, options, &result ) ) {
+      error = result.error;
     }
 
+    thumbnail_result_clear( &result );
     g_object_unref( process );
     vips_shutdown();
   }
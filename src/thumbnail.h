@@ -1,3 +1,6 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif /*HAVE_CONFIG_H*/
@@ -10,13 +13,32 @@
 
 #include <vips/vips.h>
 
+#include "logging.h"
+#include "pool.h"
+
 #define ORIENTATION ("exif-ifd0-Orientation")
+#define PAGE_HEIGHT ("page-height")
 
 typedef enum {
   ONLY_SHRINK_LARGER, // '>''
   FILL_AREA
 } ResizeConstraint;
 
+/* Extra things to work out from the thumbnail while we have it in hand.
+ */
+typedef enum {
+  THUMBNAIL_ANALYTICS_PHASH = 1,      // 64-bit DCT perceptual hash
+  THUMBNAIL_ANALYTICS_COLOURS = 2,    // most common colours
+  THUMBNAIL_ANALYTICS_BLURHASH = 4    // blurhash placeholder
+} ThumbnailAnalytics;
+
+#define THUMBNAIL_MAX_COLOURS (5)
+#define THUMBNAIL_BLURHASH_LENGTH (28)
+
+/* Most encodings one job can write.
+ */
+#define THUMBNAIL_MAX_OUTPUTS (8)
+
 typedef struct {
   int thumbnail_width;
   int thumbnail_height;
@@ -34,6 +56,29 @@ typedef struct {
 
   const char* output_format;
   const char* context_name;
+
+  int analytics;
+
+  const char* pyramid_output;
+  int pyramid_tile_size;
+  int pyramid_overlap;
+  const char* pyramid_suffix;
+  const char* pyramid_layout;
+
+  size_t max_bytes;
+
+  int threads;
+  int cache_tile_height;
+  int cache_max_tiles;
+
+  ThumbnailLog* log;
+
+  const char** output_formats;
+
+  int page;
+  int n_pages;
+
+  gboolean passthrough;
 } ThumbnailOptions;
 
 inline
@@ -54,15 +99,159 @@ ThumbnailOptions ThumbnailOptionsWithDefaults() {
     FALSE,        // delete_profile
 
     NULL,          // output_format
-    "cuticle"
+    "cuticle",
+
+    0,            // analytics
+
+    NULL,         // pyramid_output
+    254,          // pyramid_tile_size
+    1,            // pyramid_overlap
+    ".jpeg",      // pyramid_suffix
+    "dz",         // pyramid_layout
+
+    0,            // max_bytes
+
+    0,            // threads, 0 to pick from the image size, 1 for the calling thread only
+    0,            // cache_tile_height, 0 to pick from the line size
+    0,            // cache_max_tiles, 0 to pick from the memory budget
+
+    NULL,         // log, NULL for thumbnail_log_default
+
+    NULL,         // output_formats, NULL-terminated, replaces output_format
+
+    0,            // page, the first page or frame to load
+    1,            // n_pages, -1 for every page from page on
+
+    TRUE          // passthrough, copy sources that need no processing
   };
 
   return options;
 }
 
+/* Where to read an image from. If data is set the image is decoded from
+ * memory and filename is only used to name the output, otherwise filename
+ * is the file to load.
+ */
+typedef struct {
+  const char* filename;
+  const void* data;
+  size_t length;
+} ThumbnailSource;
+
+/* Why a job failed. 1 and 2 keep the meaning they had as bare status codes.
+ * Pipelines are lazy, so a damaged source may only show up at render or
+ * save time.
+ */
+typedef enum {
+  THUMBNAIL_OK = 0,
+  THUMBNAIL_ERROR_INIT = 1,       // unable to start VIPS
+  THUMBNAIL_ERROR_PROCESS = 2,    // resize, colour, render or analytics
+  THUMBNAIL_ERROR_OPTIONS = 3,    // bad sharpen mask or interpolator
+  THUMBNAIL_ERROR_LOAD = 4,       // unable to open or identify the source
+  THUMBNAIL_ERROR_SAVE = 5,       // unable to encode or write an output
+  THUMBNAIL_ERROR_REQUEST = 6     // malformed request or unsafe output name
+} ThumbnailError;
+
+/* One encoding of the thumbnail. name is the file written; when the output
+ * format is a bare suffix (eg. ".jpg[Q=80]") the encoded image is returned
+ * in data instead. data is from the buffer pool, see pool.h.
+ *
+ * With max_bytes, quality is the Q the output was encoded at, and 
+ * over_budget is set if even the lowest quality we try didn't fit.
+ */
+typedef struct {
+  char* name;
+  void* data;
+  size_t length;
+  int quality;
+  gboolean over_budget;
+} ThumbnailOutput;
+
+/* What a job produced, free with thumbnail_result_clear(). outputs are in
+ * the order of output_formats, or just output_format.
+ *
+ * pyramid_name is the tile pyramid written, if pyramid_output was set.
+ *
+ * analytics flags which of the fields after it were filled in. colours are
+ * 0xRRGGBB, most common first.
+ *
+ * n_frames is the number of pages or frames in the output, 1 unless n_pages
+ * was set and the source had more than one.
+ *
+ * threads, cache_tile_height, cache_max_tiles and cache_bytes record how the
+ * job was run, see thumbnail_shrink(). threads is 1 for a job rendered in
+ * the calling thread, the vips concurrency for one rendered on the vips
+ * pool, or the number of frames run side by side. pool is a snapshot of
+ * the buffer pool counts as the job finished.
+ *
+ * If the job failed, error says why and error_message has the detail.
+ */
+typedef struct {
+  int n_outputs;
+  ThumbnailOutput outputs[THUMBNAIL_MAX_OUTPUTS];
+  char* pyramid_name;
+
+  int analytics;
+  guint64 phash;
+  int n_colours;
+  unsigned int colours[THUMBNAIL_MAX_COLOURS];
+  char blurhash[THUMBNAIL_BLURHASH_LENGTH + 1];
+
+  int n_frames;
+
+  int threads;
+  int cache_tile_height;
+  int cache_max_tiles;
+  size_t cache_bytes;
+
+  ThumbnailPoolStats pool;
+
+  ThumbnailError error;
+  char* error_message;
+} ThumbnailResult;
+
 int
 thumbnail_process( VipsObject *process, const char *filename, ThumbnailOptions options );
 
+int
+thumbnail_process_source( VipsObject *process, ThumbnailSource source, ThumbnailOptions options, ThumbnailResult *result );
+
+void
+thumbnail_result_clear( ThumbnailResult *result );
+
+/* A short name for an error, like "load".
+ */
+const char *
+thumbnail_error_name( ThumbnailError error );
+
+/* Given (eg.) "/poop/somefile.png" and "/poop/tn_%s.jpg", make the output
+ * name (eg.) "/poop/tn_somefile.jpg", any save options included. NULL if
+ * @format isn't a safe format. Free with g_free().
+ */
+char *
+thumbnail_output_name( const char *format, const char *filename );
+
+/* Is there a loader for @filename. Unlike vips_foreign_find_load(), a file
+ * that isn't an image leaves nothing in the error buffer.
+ */
+gboolean
+thumbnail_is_image( const char *filename );
+
+/* Parse a comma-separated list like "phash,colours,blurhash" into
+ * ThumbnailAnalytics flags, -1 if there's a name we don't know.
+ */
+int
+thumbnail_analytics_parse( const char *list );
+
+/* Limit the memory all running jobs may use for scanline caches. The 
+ * default is THUMBNAIL_CACHE_BUDGET.
+ */
+#define THUMBNAIL_CACHE_BUDGET (256 * 1024 * 1024)
+
+void
+thumbnail_set_cache_budget( size_t bytes );
+
 int
 simple_transform(const char* filename, ThumbnailOptions options);
 
+#endif /*THUMBNAIL_H*/
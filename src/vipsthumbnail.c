@@ -52,7 +52,7 @@
  */
 
 
-#include "thumbnail.h"
+#include "hangnail.h"
 #include <locale.h>
 #include <regex.h>
 
@@ -60,18 +60,40 @@
 
 static char* default_cuticle_context_name = "cuticle";
 static char* context_name_arg = NULL;
+static char *context_name = NULL;
 static char *thumbnail_size = "128";
 static int thumbnail_width = 128;
 static int thumbnail_height = 128;
-static char *output_format = "tn_%s.jpg";
+static char **output_formats = NULL;
 static char *interpolator = "bilinear";
 static char *export_profile = NULL;
 static char *import_profile = NULL;
 static char *convolution_mask = "mild";
 static gboolean delete_profile = FALSE;
+static gboolean reencode = FALSE;
 static gboolean linear_processing = FALSE;
 static gboolean crop_image = FALSE;
 static gboolean rotate_image = FALSE;
+static char *serve_socket = NULL;
+static char *client_socket = NULL;
+static int jobs = 0;
+static gboolean sync_tree = FALSE;
+static gboolean watch_tree = FALSE;
+static char *analytics = NULL;
+static char *pyramid_output = NULL;
+static int pyramid_tile_size = 254;
+static int pyramid_overlap = 1;
+static char *pyramid_suffix = ".jpeg";
+static char *pyramid_layout = "dz";
+static int max_bytes = 0;
+static int page = 0;
+static int n_pages = 1;
+static int threads = 0;
+static int cache_tile_height = 0;
+static int cache_max_tiles = 0;
+static int cache_budget = 0;
+static gboolean json_output = FALSE;
+static char *log_level = NULL;
 
 /* Deprecated and unused.
  */
@@ -87,8 +109,8 @@ static GOptionEntry options[] = {
     N_( "shrink to SIZE or to WIDTHxHEIGHT" ), 
     N_( "SIZE" ) },
   { "output", 'o', 0, 
-    G_OPTION_ARG_STRING, &output_format, 
-    N_( "set output to FORMAT" ), 
+    G_OPTION_ARG_STRING_ARRAY, &output_formats, 
+    N_( "set output to FORMAT, repeat for more than one" ), 
     N_( "FORMAT" ) },
   { "interpolator", 'p', 0, 
     G_OPTION_ARG_STRING, &interpolator, 
@@ -122,6 +144,86 @@ static GOptionEntry options[] = {
   { "delete", 'd', 0, 
     G_OPTION_ARG_NONE, &delete_profile, 
     N_( "delete profile from exported image" ), NULL },
+  { "reencode", 'E', 0, 
+    G_OPTION_ARG_NONE, &reencode, 
+    N_( "always re-encode, never copy a source that needs no changes" ), NULL },
+  { "max-bytes", 'm', 0, 
+    G_OPTION_ARG_INT, &max_bytes, 
+    N_( "pick the best quality that fits in N bytes" ), 
+    N_( "N" ) },
+  { "page", 'f', 0, 
+    G_OPTION_ARG_INT, &page, 
+    N_( "start from page or frame N" ), 
+    N_( "N" ) },
+  { "pages", 'u', 0, 
+    G_OPTION_ARG_INT, &n_pages, 
+    N_( "thumbnail N pages or frames, -1 for all" ), 
+    N_( "N" ) },
+  { "analytics", 'A', 0, 
+    G_OPTION_ARG_STRING, &analytics, 
+    N_( "also compute LIST of phash,colours,blurhash" ), 
+    N_( "LIST" ) },
+  { "pyramid", 'P', 0, 
+    G_OPTION_ARG_STRING, &pyramid_output, 
+    N_( "also write a tile pyramid to NAME" ), 
+    N_( "NAME" ) },
+  { "tile-size", 'T', 0, 
+    G_OPTION_ARG_INT, &pyramid_tile_size, 
+    N_( "pyramid tiles are SIZE pixels across" ), 
+    N_( "SIZE" ) },
+  { "overlap", 'O', 0, 
+    G_OPTION_ARG_INT, &pyramid_overlap, 
+    N_( "pyramid tiles overlap by N pixels" ), 
+    N_( "N" ) },
+  { "tile-format", 'F', 0, 
+    G_OPTION_ARG_STRING, &pyramid_suffix, 
+    N_( "save pyramid tiles as SUFFIX" ), 
+    N_( "SUFFIX" ) },
+  { "layout", 'L', 0, 
+    G_OPTION_ARG_STRING, &pyramid_layout, 
+    N_( "pyramid layout dz|zoomify|google" ), 
+    N_( "LAYOUT" ) },
+  { "threads", 'N', 0, 
+    G_OPTION_ARG_INT, &threads, 
+    N_( "1 renders each job in its own thread, more lets it use the vips pool, or N frames at once" ), 
+    N_( "N" ) },
+  { "cache-tile-height", 'H', 0, 
+    G_OPTION_ARG_INT, &cache_tile_height, 
+    N_( "cache input in tiles N lines high" ), 
+    N_( "N" ) },
+  { "cache-tiles", 'K', 0, 
+    G_OPTION_ARG_INT, &cache_max_tiles, 
+    N_( "cache at most N tiles of input per job" ), 
+    N_( "N" ) },
+  { "cache-budget", 'B', 0, 
+    G_OPTION_ARG_INT, &cache_budget, 
+    N_( "share MB of input cache between running jobs" ), 
+    N_( "MB" ) },
+  { "log", 'g', 0, 
+    G_OPTION_ARG_STRING, &log_level, 
+    N_( "log from LEVEL debug|info|warn|error|none" ), 
+    N_( "LEVEL" ) },
+  { "json", 'J', 0, 
+    G_OPTION_ARG_NONE, &json_output, 
+    N_( "print a line of JSON for each thumbnail" ), NULL },
+  { "serve", 'S', 0, 
+    G_OPTION_ARG_STRING, &serve_socket, 
+    N_( "serve jobs on unix socket SOCKET" ), 
+    N_( "SOCKET" ) },
+  { "client", 'C', 0, 
+    G_OPTION_ARG_STRING, &client_socket, 
+    N_( "send jobs to the server on SOCKET" ), 
+    N_( "SOCKET" ) },
+  { "jobs", 'j', 0, 
+    G_OPTION_ARG_INT, &jobs, 
+    N_( "run at most N jobs at once when serving or syncing" ), 
+    N_( "N" ) },
+  { "sync", 'y', 0, 
+    G_OPTION_ARG_NONE, &sync_tree, 
+    N_( "sync thumbnails of SRC_DIR into DST_DIR" ), NULL },
+  { "watch", 'w', 0, 
+    G_OPTION_ARG_NONE, &watch_tree, 
+    N_( "with --sync, keep watching SRC_DIR for changes" ), NULL },
   { "verbose", 'v', G_OPTION_FLAG_HIDDEN, 
     G_OPTION_ARG_NONE, &verbose, 
     N_( "(deprecated, does nothing)" ), NULL },
@@ -181,6 +283,98 @@ parse_thumbnail_size(char *thumbnail_size, int* w, int* h, ResizeConstraint* con
   return status;
 }
 
+static void
+print_json_string( const char *text )
+{
+  const char *p;
+
+  putchar( '"' );
+  for( p = text; *p; p++ ) {
+    if( *p == '"' || *p == '\\' )
+      printf( "\\%c", *p );
+    else if( (unsigned char) *p < 0x20 )
+      printf( "\\u%04x", *p );
+    else
+      putchar( *p );
+  }
+  putchar( '"' );
+}
+
+static void
+print_json_output( ThumbnailOutput *output )
+{
+  if( output->name ) {
+    printf( ",\"output\":" );
+    print_json_string( output->name );
+  }
+
+  if( output->quality ) {
+    printf( ",\"quality\":%d,\"over_budget\":%s", 
+      output->quality, output->over_budget ? "true" : "false" );
+  }
+}
+
+static void
+print_json( const char *filename, ThumbnailResult *result )
+{
+  int i;
+
+  printf( "{\"source\":" );
+  print_json_string( filename );
+
+  /* The first output at the top level, as before, and all of them in
+   * outputs if there's more than one.
+   */
+  if( result->n_outputs ) {
+    print_json_output( &result->outputs[0] );
+  }
+
+  if( result->n_outputs > 1 ) {
+    printf( ",\"outputs\":[" );
+    for( i = 0; i < result->n_outputs; i++ ) {
+      printf( "%s{\"index\":%d", i ? "," : "", i );
+      print_json_output( &result->outputs[i] );
+      printf( "}" );
+    }
+    printf( "]" );
+  }
+
+  if( result->n_frames > 1 ) {
+    printf( ",\"frames\":%d", result->n_frames );
+  }
+
+  if( result->pyramid_name ) {
+    printf( ",\"pyramid\":" );
+    print_json_string( result->pyramid_name );
+  }
+
+  if( result->analytics & THUMBNAIL_ANALYTICS_PHASH ) {
+    printf( ",\"phash\":\"%016" G_GINT64_MODIFIER "x\"", result->phash );
+  }
+
+  if( result->analytics & THUMBNAIL_ANALYTICS_COLOURS ) {
+    printf( ",\"colours\":[" );
+    for( i = 0; i < result->n_colours; i++ ) {
+      printf( "%s\"#%06x\"", i ? "," : "", result->colours[i] );
+    }
+    printf( "]" );
+  }
+
+  if( result->analytics & THUMBNAIL_ANALYTICS_BLURHASH ) {
+    printf( ",\"blurhash\":" );
+    print_json_string( result->blurhash );
+  }
+
+  if( result->threads ) {
+    printf( ",\"threads\":%d,\"cache\":{\"tile_height\":%d,\"tiles\":%d,\"bytes\":%zu}", 
+      result->threads, result->cache_tile_height, result->cache_max_tiles, result->cache_bytes );
+    printf( ",\"pool\":{\"hits\":%" G_GUINT64_FORMAT ",\"misses\":%" G_GUINT64_FORMAT ",\"held_bytes\":%zu}",
+      result->pool.hits, result->pool.misses, result->pool.held_bytes );
+  }
+
+  printf( "}\n" );
+}
+
 int
 main( int argc, char **argv )
 {
@@ -211,46 +405,111 @@ main( int argc, char **argv )
 
   g_option_context_free( context );
 
+  thumbnail_log_init();
+
+  if( log_level ) {
+    int level;
+
+    if( (level = thumbnail_log_level_parse( log_level )) < 0 ) {
+      fprintf( stderr, "Unknown log level: '%s'\n", log_level );
+      exit(1);
+    }
+    thumbnail_log_default.level = level;
+  }
+
   if(parse_thumbnail_size(thumbnail_size, &thumbnail_width, &thumbnail_height, &resize_constraint)) {
     fprintf( stderr, "Undable to parse thumbnail size: '%s'\n", thumbnail_size);
     exit(1);
   }
 
+  ThumbnailOptions thumb_options = ThumbnailOptionsWithDefaults();
+  thumb_options.thumbnail_height = thumbnail_height;
+  thumb_options.thumbnail_width = thumbnail_width;
+  thumb_options.crop_image = crop_image;
+  thumb_options.rotate_image = rotate_image;
+  thumb_options.convolution_mask = convolution_mask;
+  thumb_options.interpolator = interpolator;
+  thumb_options.import_profile = import_profile;
+  thumb_options.export_profile = export_profile;
+  thumb_options.delete_profile = delete_profile;
+  thumb_options.passthrough = !reencode;
+  thumb_options.output_format = output_formats ? output_formats[0] : "tn_%s.jpg";
+
+  /* One pipeline, several encodings.
+   */
+  if( output_formats && output_formats[1] ) {
+    thumb_options.output_formats = (const char **) output_formats;
+  }
+  thumb_options.resize_constraint = resize_constraint;
+  thumb_options.max_bytes = VIPS_MAX( 0, max_bytes );
+  thumb_options.page = VIPS_MAX( 0, page );
+  thumb_options.n_pages = n_pages < 0 ? -1 : VIPS_MAX( 1, n_pages );
+  thumb_options.pyramid_output = pyramid_output;
+  thumb_options.pyramid_tile_size = pyramid_tile_size;
+  thumb_options.pyramid_overlap = pyramid_overlap;
+  thumb_options.pyramid_suffix = pyramid_suffix;
+  thumb_options.pyramid_layout = pyramid_layout;
+  thumb_options.threads = threads;
+  thumb_options.cache_tile_height = cache_tile_height;
+  thumb_options.cache_max_tiles = cache_max_tiles;
+
+  if( cache_budget > 0 ) {
+    thumbnail_set_cache_budget( (size_t) cache_budget * 1024 * 1024 );
+  }
+
+  if( analytics &&
+    (thumb_options.analytics = thumbnail_analytics_parse( analytics )) < 0 ) {
+    char *message = thumbnail_error_take();
+
+    fprintf( stderr, "%s\n", message );
+    g_free( message );
+    vips_error_exit( "try \"%s --help\"", g_get_prgname() );
+  }
+
+  if( context_name_arg ) {
+    context_name = g_strdup_printf( "%s %s", default_cuticle_context_name, context_name_arg );
+    thumb_options.context_name = context_name;
+  }
+
+  if( serve_socket ) {
+    exit( hangnail_serve( serve_socket, thumb_options, jobs ) );
+  }
+
+  if( sync_tree ) {
+    if( argc != 3 ) {
+      fprintf( stderr, "usage: %s --sync [options] SRC_DIR DST_DIR\n", g_get_prgname() );
+      exit(1);
+    }
+
+    exit( hangnail_sync( argv[1], argv[2], thumb_options, jobs, watch_tree ) );
+  }
+
+  if( client_socket ) {
+    exit( hangnail_client( client_socket, thumb_options, context_name_arg, argv + 1, argc - 1 ) );
+  }
+
   for( i = 1; i < argc; i++ ) {
     /* Hang resources for processing this thumbnail off @process.
      */
     VipsObject *process = VIPS_OBJECT( vips_image_new() ); 
+    ThumbnailSource source = { argv[i], NULL, 0 };
+    ThumbnailResult result = { 0 };
 
-    ThumbnailOptions thumb_options = ThumbnailOptionsWithDefaults();
-    thumb_options.thumbnail_height = thumbnail_height;
-    thumb_options.thumbnail_width = thumbnail_width;
-    thumb_options.crop_image = crop_image;
-    thumb_options.rotate_image = rotate_image;
-    thumb_options.convolution_mask = convolution_mask;
-    thumb_options.interpolator = interpolator;
-    thumb_options.import_profile = import_profile;
-    thumb_options.export_profile = export_profile;
-    thumb_options.delete_profile = delete_profile;
-    thumb_options.output_format = output_format;
-    thumb_options.resize_constraint = resize_constraint;
-
-    if(context_name_arg) {
-      char* buffer = malloc(sizeof(char)*(strlen(context_name_arg) + strlen(default_cuticle_context_name) + 2)); // buffer is long enough for ' ' and null terminator
-      sprintf(buffer, "%s %s", default_cuticle_context_name, context_name_arg);
-      thumb_options.context_name = buffer;
+    /* The job logs why it failed, exit with the reason.
+     */
+    if( thumbnail_process_source( process, source, thumb_options, &result ) ) {
+      exit( result.error );
     }
 
-    if( thumbnail_process( process, argv[i], thumb_options ) ) {
-      fprintf( stderr, "%s: unable to thumbnail %s\n", 
-        argv[0], argv[i] );
-      fprintf( stderr, "%s", vips_error_buffer() );
-      vips_error_clear();
-      exit(1);
+    if( json_output ) {
+      print_json( argv[i], &result );
     }
 
+    thumbnail_result_clear( &result );
     g_object_unref( process );
   }
 
+  g_free( context_name );
   vips_shutdown();
 
   return( 0 );